@@ -1,336 +1,2185 @@
 #include "allocator.h"
 
-void Allocator::del_block_used(int id)
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static int msb(size_t x)
+{
+    return 63 - __builtin_clzll(x);
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The first block start at or after at whose payload is a multiple of
+// align; the bytes skipped are none or enough for a free block.
+static int8_t *aligned_spot(int8_t *at, size_t align)
+{
+    uintptr_t p = reinterpret_cast<uintptr_t>(at) + header_size;
+    uintptr_t q = (p + align - 1) & ~(align - 1);
+    if (q != p && q - p < min_block)
+        q = (p + min_block + align - 1) & ~(align - 1);
+    return reinterpret_cast<int8_t*>(q - header_size);
+}
+
+// Compaction moves of at least this many bytes bypass the cache: the data
+// moved is usually cold, and copying it through the cache would evict the
+// caller's working set.
+static const size_t stream_copy_min = 1 << 20;
+
+#if defined(__x86_64__)
+// Ascending copies of 64 (128) byte rounds with non-temporal stores to a
+// 64-byte aligned dst, returning the bytes copied. Every round loads before
+// it stores, so dst may overlap src as long as it lies below it.
+static size_t stream_copy_sse2(int8_t *dst, const int8_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 32));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 48));
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + i), a);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + i + 16), b);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + i + 32), c);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + i + 48), d);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t stream_copy_avx2(int8_t *dst, const int8_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 128 <= n; i += 128)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 32));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 64));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 96));
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i), a);
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i + 32), b);
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i + 64), c);
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i + 96), d);
+    }
+    return i;
+}
+#endif
+
+// memmove() for compaction, which only ever moves data down: dst is below
+// src or the two don't overlap.
+static void move_down(void *_dst, const void *_src, size_t n)
+{
+    int8_t *dst = static_cast<int8_t*>(_dst);
+    const int8_t *src = static_cast<const int8_t*>(_src);
+    if (n < stream_copy_min || dst == src)
+    {
+        memmove(dst, src, n);
+        return;
+    }
+
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+
+    // Head, body and tail go in ascending order, which keeps each part's
+    // source clear of the parts written before it.
+    size_t head = (0 - reinterpret_cast<uintptr_t>(dst)) & 63;
+    memmove(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+
+    size_t done = avx2 ? stream_copy_avx2(dst, src, n) : stream_copy_sse2(dst, src, n);
+    _mm_sfence();
+    memmove(dst + done, src + done, n - done);
+#else
+    memmove(dst, src, n);
+#endif
+}
+
+// Extra bytes a free block needs so that aligned_spot() fits b_size in it.
+static size_t fit_padding(size_t align)
+{
+    return align > block_align ? min_block + align - block_align : 0;
+}
+
+static size_t huge_page_size()
+{
+    size_t kb = 2048;
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f != NULL)
+    {
+        char line[128];
+        while (fgets(line, sizeof(line), f) != NULL)
+        {
+            if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1)
+                break;
+        }
+        fclose(f);
+    }
+    return kb << 10;
+}
+
+// Chunks are whole pages and a power of two, so they can be aligned by masking.
+static size_t round_chunk(size_t chunk, size_t page)
+{
+    if (chunk < page)
+        chunk = page;
+    return (size_t) 1 << (64 - __builtin_clzll(chunk - 1));
+}
+
+template <class Placement>
+BasicAllocator<Placement>::BasicAllocator(const ArenaConfig &config, bool concurrent) :
+    BasicAllocator(map_arena(config), concurrent)
+{
+    if (config.path != NULL)
+        open_file(config.path);
+}
+
+template <class Placement>
+BasicAllocator<Placement>::BasicAllocator(const MappedArena &m, bool concurrent) :
+    BasicAllocator(m.at, m.chunk, concurrent)
+{
+    reserved = m.reserve;
+    chunk = m.chunk;
+    pages = m.pages;
+    map_threshold = m.map_threshold;
+}
+
+template <class Placement>
+MappedArena BasicAllocator<Placement>::map_arena(const ArenaConfig &config)
+{
+    bool huge = config.huge_pages && config.path == NULL;
+    size_t page = huge ? huge_page_size() : sysconf(_SC_PAGESIZE);
+
+    MappedArena m;
+    m.chunk = round_chunk(config.chunk, page);
+    m.reserve = (config.reserve + m.chunk - 1) & ~(m.chunk - 1);
+    if (m.reserve < m.chunk)
+        m.reserve = m.chunk;
+    m.pages = PagesDefault;
+    m.map_threshold = config.path == NULL ? config.map_threshold : 0;
+    m.at = MAP_FAILED;
+
+    // Reserve the address space inaccessible, then commit the first chunk.
+    // Explicit huge pages are taken for the whole reservation up front, so
+    // the mapping fails rather than faulting later if there are too few.
+    if (huge)
+    {
+        m.at = mmap(NULL, m.reserve, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (m.at != MAP_FAILED)
+            m.pages = PagesHuge;
+    }
+
+    if (m.at == MAP_FAILED)
+    {
+        // Over-reserve by a page so that the arena can start page-aligned:
+        // transparent huge pages are only used for aligned ranges.
+        size_t slack = huge ? page : 0;
+        void *at = mmap(NULL, m.reserve + slack, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (at == MAP_FAILED)
+            throw AllocError(NoMemory, "mmap()");
+
+        uintptr_t lo = reinterpret_cast<uintptr_t>(at);
+        uintptr_t start = (lo + slack) & ~(uintptr_t) (slack ? slack - 1 : 0);
+        if (start != lo)
+            munmap(at, start - lo);
+        if (start + m.reserve != lo + m.reserve + slack)
+            munmap(reinterpret_cast<void*>(start + m.reserve), lo + slack - start);
+        m.at = reinterpret_cast<void*>(start);
+
+        if (huge && madvise(m.at, m.reserve, MADV_HUGEPAGE) == 0)
+            m.pages = PagesTransparent;
+    }
+
+    if (mprotect(m.at, m.chunk, PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(m.at, m.reserve);
+        throw AllocError(NoMemory, "mprotect()");
+    }
+    return m;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::unmap_arena()
+{
+    if (reserved == 0)
+        return;
+
+    for (int i = 0; ops.mapped_blocks != 0 && i < handle_count; i++)
+    {
+        if (h_flags(i) & HandleMapped)
+            release_mapped(i);
+    }
+
+    if (file != NULL)
+    {
+        // Cached and retired blocks are used in the arena and would come
+        // back as live.
+        if (caches != NULL)
+            flush_caches();
+        reclaim_retired(true);
+        msync(base, size, MS_SYNC);
+    }
+    if (fd >= 0)
+        close(fd);
+    munmap(base, reserved);
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::open_file(const char *path)
+{
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        throw AllocError(InvalidArena, "open()");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        throw AllocError(InvalidArena, "fstat()");
+
+    ArenaFile head;
+    bool fresh = st.st_size == 0;
+    if (!fresh && (pread(fd, &head, sizeof(head), 0) != (ssize_t) sizeof(head) ||
+                   head.magic != arena_file_magic || head.size != (uint64_t) st.st_size ||
+                   head.size > reserved || head.size % sysconf(_SC_PAGESIZE) != 0))
+        throw AllocError(InvalidArena, "Not an arena file");
+
+    size_t bytes = fresh ? chunk : head.size;
+    if (fresh && ftruncate(fd, bytes) != 0)
+        throw AllocError(NoMemory, "ftruncate()");
+
+    // The file takes the place of the anonymous memory at the start of the
+    // reservation, which the constructor has set up as an empty arena.
+    if (mmap(base, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+        throw AllocError(NoMemory, "mmap()");
+    file = reinterpret_cast<ArenaFile*>(base);
+    size = bytes;
+    reset_free_lists();
+
+    if (fresh)
+    {
+        file->magic = arena_file_magic;
+        file->size = bytes;
+        file->root = -1;
+        init_arena();
+    }
+    else
+    {
+        restore_arena();
+    }
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::restore_arena()
+{
+    arena_bounds();
+
+    // Free blocks go back on the free lists (their links are addresses from
+    // the previous mapping); used blocks name the handle that owns them.
+    int max_id = -1;
+    for (BlockHeader *b = first; b != last; b = next_block(b))
+    {
+        size_t b_size = block_size(b);
+        if (b_size < min_block ||
+            b_size > (size_t) (reinterpret_cast<int8_t*>(last) - reinterpret_cast<int8_t*>(b)))
+            throw AllocError(InvalidArena, "Corrupt arena file");
+
+        if (b->size & BlockFree)
+            insert_free(static_cast<FreeBlock*>(b));
+        else if (owner(b) < 0 || owner(b) >= max_handle_segs * handle_seg_size)
+            throw AllocError(InvalidArena, "Corrupt arena file");
+        else
+            max_id = std::max(max_id, owner(b));
+    }
+
+    for (int k = 0; k * handle_seg_size <= max_id; k++)
+        handle_segs[k] = new HandleSeg();
+    handle_count = max_id + 1;
+
+    for (BlockHeader *b = first; b != last; b = next_block(b))
+    {
+        if (b->size & BlockFree)
+            continue;
+
+        int id = owner(b);
+        if (h_flags(id) != 0)
+            throw AllocError(InvalidArena, "Corrupt arena file");
+        h_offset(id) = reinterpret_cast<int8_t*>(b) + header_size - base;
+        h_size(id) = block_size(b) - header_size;
+        h_flags(id) = HandleLive | (uint32_t) (b->handle >> 32) << align_shift;
+        set_bin(id, block_size(b));
+    }
+
+    for (int id = handle_count - 1; id >= 0; id--)
+    {
+        if (h_flags(id) == 0)
+            free_handles.push_back(id);
+    }
+}
+
+template <class Placement>
+FreeBlock *BasicAllocator<Placement>::grow(size_t b_size)
+{
+    // A free block at the end of the arena only needs to be extended.
+    size_t tail = (last->size & PrevFree) ? block_size(prev_block(last)) : 0;
+    size_t more = (b_size - tail + chunk - 1) & ~(chunk - 1);
+    if (b_size > reserved || size + more > reserved)
+        return NULL;
+
+    if (file != NULL)
+    {
+        if (ftruncate(fd, size + more) != 0 ||
+            mmap(base + size, more, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 fd, size) == MAP_FAILED)
+            return NULL;
+    }
+    else if (mprotect(base + size, more, PROT_READ | PROT_WRITE) != 0)
+    {
+        return NULL;
+    }
+    size += more;
+    if (file != NULL)
+        file->size = size;
+    ops.arena_grows++;
+
+    // The old sentinel becomes the header of the new space. Not through
+    // add_block_free(): fresh pages have nothing to release.
+    BlockHeader *block = last;
+    last = reinterpret_cast<BlockHeader*>(reinterpret_cast<int8_t*>(last) + more);
+    last->size = 0;
+    last->handle = 0;
+    block->size &= PrevFree;
+    if (tail != 0)
+    {
+        BlockHeader *prev = prev_block(block);
+        remove_free(static_cast<FreeBlock*>(prev));
+        block_merged(block, prev);
+        block = prev;
+        more += tail;
+    }
+    set_free(block, more);
+    insert_free(static_cast<FreeBlock*>(block));
+
+    return placement.find(*this, b_size);
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::release_chunks(int8_t *lo, int8_t *hi)
+{
+    // Gives the whole chunks in [lo, hi) back; they read as zeros if reused.
+    uintptr_t from = (reinterpret_cast<uintptr_t>(lo) + chunk - 1) & ~(chunk - 1);
+    uintptr_t to = reinterpret_cast<uintptr_t>(hi) & ~(chunk - 1);
+    // In a file, MADV_REMOVE frees the disk blocks as well.
+    int advice = file != NULL ? MADV_REMOVE : MADV_DONTNEED;
+    if (from < to && madvise(reinterpret_cast<void*>(from), to - from, advice) == 0)
+        ops.released_bytes += to - from;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::arena_bounds()
+{
+    uintptr_t lo = reinterpret_cast<uintptr_t>(base) + (file ? sizeof(ArenaFile) : 0);
+    uintptr_t hi = reinterpret_cast<uintptr_t>(base) + size;
+    lo = (lo + block_align - 1) & ~(block_align - 1);
+    hi = hi & ~(block_align - 1);
+
+    if (hi < lo + min_block + header_size)
+        throw AllocError(NoMemory, "Arena too small");
+
+    first = reinterpret_cast<BlockHeader*>(lo);
+    last = reinterpret_cast<BlockHeader*>(hi - header_size);
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::init_arena()
+{
+    arena_bounds();
+    last->size = 0;
+    last->handle = 0;
+
+    first->size = 0;
+    add_block_free(first, reinterpret_cast<int8_t*>(last) -
+                          reinterpret_cast<int8_t*>(first));
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::del_handle(int id)
+{
+    h_flags(id) = 0;
+    free_handles.push_back(id);
+}
+
+template <class Placement>
+int BasicAllocator<Placement>::add_handle(int8_t *start, size_t N)
+{
+    int i;
+    if (!free_handles.empty())
+    {
+        i = free_handles.back();
+        free_handles.pop_back();
+    }
+    else
+    {
+        if ((handle_count & (handle_seg_size - 1)) == 0)
+        {
+            if (handle_count == max_handle_segs * handle_seg_size)
+                throw AllocError(NoMemory, "Maximum pointers reached");
+            handle_segs[handle_count >> handle_seg_log2] = new HandleSeg();
+        }
+        i = handle_count++;
+    }
+
+    h_offset(i) = offset_of(start);
+    h_size(i) = N;
+    h_flags(i) = HandleLive;
+    h_cache(i) = 0;
+    return i;
+}
+
+template <class Placement>
+BlockHeader *BasicAllocator<Placement>::prev_block(BlockHeader *b)
+{
+    int8_t *footer = reinterpret_cast<int8_t*>(b) - sizeof(size_t);
+    return reinterpret_cast<BlockHeader*>(
+            reinterpret_cast<int8_t*>(b) - *reinterpret_cast<size_t*>(footer));
+}
+
+template <class Placement>
+size_t BasicAllocator<Placement>::block_for(size_t N)
+{
+    if (N > ~(size_t) 0 / 2)
+        return ~block_flags;
+
+    size_t b_size = (N + header_size + block_align - 1) & ~(block_align - 1);
+    return b_size < min_block ? min_block : b_size;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::set_free(BlockHeader *b, size_t b_size)
+{
+    b->size = b_size | BlockFree | (b->size & PrevFree);
+
+    int8_t *footer = reinterpret_cast<int8_t*>(b) + b_size - sizeof(size_t);
+    *reinterpret_cast<size_t*>(footer) = b_size;
+
+    next_block(b)->size |= PrevFree;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::set_used(BlockHeader *b, size_t b_size)
+{
+    b->size = b_size | (b->size & PrevFree);
+    next_block(b)->size &= ~(size_t) PrevFree;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::add_block_free(BlockHeader *block, size_t b_size)
+{
+    int8_t *lo = reinterpret_cast<int8_t*>(block);
+    int8_t *hi = lo + b_size;
+    merges++;
+
+    if (block->size & PrevFree)
+    {
+        BlockHeader *prev = prev_block(block);
+        remove_free(static_cast<FreeBlock*>(prev));
+        b_size += block_size(prev);
+        block_merged(block, prev);
+        block = prev;
+    }
+
+    BlockHeader *next = reinterpret_cast<BlockHeader*>(
+            reinterpret_cast<int8_t*>(block) + b_size);
+    if (next->size & BlockFree)
+    {
+        remove_free(static_cast<FreeBlock*>(next));
+        b_size += block_size(next);
+        block_merged(next, block);
+    }
+
+    set_free(block, b_size);
+    insert_free(static_cast<FreeBlock*>(block));
+
+    // Chunks lying wholly in the merged neighbours went back when those
+    // were freed, so only the ones touching [lo, hi) are new.
+    if (reserved != 0 && b_size >= chunk)
+    {
+        int8_t *start = reinterpret_cast<int8_t*>(block);
+        lo = std::max(start + sizeof(FreeBlock), lo - (chunk - 1));
+        hi = std::min(start + b_size - sizeof(size_t), hi + (chunk - 1));
+        release_chunks(lo, hi);
+    }
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::split_block(BlockHeader *block, size_t total, size_t b_size)
 {
-    delete blocks_used[id];
-    blocks_used[id] = NULL;
+    if (total - b_size < min_block)
+    {
+        set_used(block, total);
+        return;
+    }
+
+    set_used(block, b_size);
+
+    BlockHeader *rest = next_block(block);
+    rest->size = 0;
+    set_free(rest, total - b_size);
+    insert_free(static_cast<FreeBlock*>(rest));
+}
+
+template <class Placement>
+BlockHeader *BasicAllocator<Placement>::take_block(FreeBlock *block, size_t b_size)
+{
+    remove_free(block);
+    split_block(block, block_size(block), b_size);
+    return block;
+}
+
+template <class Placement>
+BlockHeader *BasicAllocator<Placement>::take_aligned(FreeBlock *block, size_t b_size,
+                                                     size_t align)
+{
+    remove_free(block);
+
+    // The bytes in front of the aligned spot stay a free block of their own.
+    int8_t *start = reinterpret_cast<int8_t*>(block);
+    size_t total = block_size(block);
+    BlockHeader *taken = reinterpret_cast<BlockHeader*>(aligned_spot(start, align));
+    size_t gap = reinterpret_cast<int8_t*>(taken) - start;
+    if (gap != 0)
+    {
+        taken->size = 0;
+        set_free(block, gap);
+        insert_free(block);
+    }
+
+    split_block(taken, total - gap, b_size);
+    return taken;
 }
 
-void Allocator::del_block_free(int id)
+template <class Placement>
+BlockHeader *BasicAllocator<Placement>::take_fit(size_t b_size, size_t align)
 {
-    delete blocks_free[id];
-    blocks_free[id] = NULL;
+    if (b_size > ~(size_t) 0 / 2)
+        return NULL;
+
+    // A block with room for the worst-case gap always has an aligned spot.
+    FreeBlock *fit = find_fit(b_size + fit_padding(align));
+    if (fit == NULL)
+        return NULL;
+    return align > block_align ? take_aligned(fit, b_size, align) : take_block(fit, b_size);
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::mapping(size_t N, int &fl, int &sl)
+{
+    if (N < (size_t) sl_count)
+    {
+        fl = 0;
+        sl = N;
+    }
+    else
+    {
+        int top = msb(N);
+        fl = top - sl_log2 + 1;
+        sl = (N >> (top - sl_log2)) - sl_count;
+    }
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::insert_free(FreeBlock *block)
+{
+    int fl, sl;
+    mapping(block_size(block), fl, sl);
+
+    block->prev_free = NULL;
+    block->next_free = free_lists[fl][sl];
+    if (block->next_free != NULL)
+        block->next_free->prev_free = block;
+
+    free_lists[fl][sl] = block;
+    fl_bitmap |= 1ULL << fl;
+    sl_bitmap[fl] |= 1U << sl;
+    free_bytes += block_size(block);
+    free_blocks++;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::remove_free(FreeBlock *block)
+{
+    int fl, sl;
+    mapping(block_size(block), fl, sl);
+
+    if (block->prev_free != NULL)
+        block->prev_free->next_free = block->next_free;
+    else
+        free_lists[fl][sl] = block->next_free;
+
+    if (block->next_free != NULL)
+        block->next_free->prev_free = block->prev_free;
+
+    free_bytes -= block_size(block);
+    free_blocks--;
+
+    if (free_lists[fl][sl] == NULL)
+    {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if (sl_bitmap[fl] == 0)
+            fl_bitmap &= ~(1ULL << fl);
+    }
+}
+
+template <class Placement>
+FreeBlock *BasicAllocator<Placement>::good_fit(size_t b_size)
+{
+    int fl, sl;
+
+    // Round b_size up to the next class boundary: then the head of any
+    // non-empty class at or above it is big enough and no list is walked.
+    size_t rounded = b_size;
+    if (b_size >= (size_t) sl_count)
+        rounded = b_size + (((size_t) 1 << (msb(b_size) - sl_log2)) - 1);
+
+    if (rounded >= b_size)
+    {
+        mapping(rounded, fl, sl);
+
+        uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+        if (sl_map == 0)
+        {
+            uint64_t fl_map = (fl + 1 < 64) ? fl_bitmap & (~0ULL << (fl + 1)) : 0;
+            if (fl_map != 0)
+            {
+                fl = __builtin_ctzll(fl_map);
+                sl_map = sl_bitmap[fl];
+            }
+        }
+
+        if (sl_map != 0)
+            return free_lists[fl][__builtin_ctz(sl_map)];
+    }
+
+    // Nothing in the larger classes: a block of b_size's own class may fit.
+    mapping(b_size, fl, sl);
+    for (FreeBlock *block = free_lists[fl][sl]; block; block = block->next_free)
+    {
+        if (block_size(block) >= b_size)
+            return block;
+    }
+
+    return NULL;
+}
+
+template <class Placement>
+FreeBlock *BasicAllocator<Placement>::scan_fit(BlockHeader *from, BlockHeader *to,
+                                               size_t b_size)
+{
+    for (BlockHeader *b = from; b != to; b = next_block(b))
+    {
+        if ((b->size & BlockFree) && block_size(b) >= b_size)
+            return static_cast<FreeBlock*>(b);
+    }
+    return NULL;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::block_merged(BlockHeader *gone, BlockHeader *into)
+{
+    // gone is no longer a block boundary: move anything that points at it.
+    if (compact_cursor == gone)
+        compact_cursor = into;
+    placement.forget(gone, into);
+}
+
+template <class Placement>
+Pointer BasicAllocator<Placement>::alloc(size_t N, size_t alignment)
+{
+    return alloc_traced(N, alignment, false);
+}
+
+template <class Placement>
+Pointer BasicAllocator<Placement>::alloc_traced(size_t N, size_t alignment, bool pinned)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+        alignment > (size_t) 1 << (align_mask >> align_shift))
+        throw AllocError(InvalidAlign, "alloc()");
+
+    Pointer pointer;
+    if (!track_latency)
+    {
+        pointer = alloc_any(N, alignment);
+    }
+    else
+    {
+        uint64_t start = now_ns();
+        pointer = alloc_any(N, alignment);
+        note_latency(OpAlloc, start);
+    }
+
+    if (trace != NULL)
+    {
+        uint64_t align_log2 = alignment > block_align ? msb(alignment) : 0;
+        trace_event(TraceAlloc, pointer.get_id(), N, align_log2 << 1 | pinned);
+    }
+    return pointer;
+}
+
+template <class Placement>
+Pointer BasicAllocator<Placement>::alloc_any(size_t N, size_t align)
+{
+    Pointer pointer;
+    if (caches != NULL && align <= block_align && cache_alloc(N, pointer))
+        return pointer;
+
+    ArenaLock guard(this);
+    reclaim_retired(false);
+    if (caches != NULL && !use_mapping(N, align) &&
+        find_fit(fit_size(N) + fit_padding(align)) == NULL)
+        flush_caches();
+    ops.allocs++;
+    return alloc_block(N, align);
+}
+
+template <class Placement>
+Pointer BasicAllocator<Placement>::alloc_block(size_t N, size_t align)
+{
+    Pointer pointer;
+
+    if (use_mapping(N, align))
+    {
+        int i = add_handle(map_block(N), N);
+        h_flags(i) |= HandleMapped;
+        set_owner(header_of(payload(i)), i);
+        return Pointer(base, seg_of(i), i);
+    }
+
+    BlockHeader *block = take_fit(fit_size(N), align);
+    
+    if (block != NULL)
+    {
+        int8_t *start = reinterpret_cast<int8_t*>(block) + header_size;
+ 
+        int i = add_handle(start, N);
+        if (align > block_align)
+            h_flags(i) |= msb(align) << align_shift;
+        set_owner(block, i);
+        set_bin(i, block_size(block));
+        pointer = Pointer(base, seg_of(i), i);
+    }
+    else
+    {
+        throw AllocError(NoMemory, "alloc()");
+    }
+
+    return pointer;
+}
+        
+template <class Placement>
+void BasicAllocator<Placement>::free(Pointer &p) 
+{
+    // Logged before the handle is released, so that a thread reusing the
+    // id can't log its alloc ahead of this free.
+    if (trace != NULL)
+        trace_event(TraceFree, p.get_id(), 0);
+
+    if (!track_latency)
+    {
+        free_any(p);
+        return;
+    }
+
+    uint64_t start = now_ns();
+    free_any(p);
+    note_latency(OpFree, start);
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::free_any(Pointer &p)
+{
+    int i = p.get_id();
+
+    if (caches == NULL || !cache_free(i))
+    {
+        ArenaLock guard(this);
+        ops.frees++;
+        release_block(i);
+    }
+
+    p.set_null();
 } 
 
-int Allocator::add_block_used(Memblock *block)
+template <class Placement>
+void BasicAllocator<Placement>::alloc_batch(const std::vector<size_t> &sizes,
+                                            std::vector<Pointer> &out)
+{
+    uint64_t start = track_latency ? now_ns() : 0;
+    out.clear();
+    if (sizes.empty())
+        return;
+    out.reserve(sizes.size());
+
+    {
+        ArenaLock guard(this);
+
+        // Blocks at or above map_threshold get a mapping each and stay out
+        // of the run.
+        size_t total = 0, run_last = 0;
+        for (size_t k = 0; k < sizes.size(); k++)
+        {
+            if (use_mapping(sizes[k], block_align))
+                continue;
+            run_last = k;
+            size_t b_size = fit_size(sizes[k]);
+            if (total > ~(size_t) 0 / 2 || b_size > ~(size_t) 0 / 2)
+                total = ~(size_t) 0;
+            else
+                total += b_size;
+        }
+
+        BlockHeader *run = total ? take_fit(total, block_align) : NULL;
+        if (run == NULL && total != 0 && caches != NULL)
+        {
+            flush_caches();
+            run = take_fit(total, block_align);
+        }
+
+        if (run != NULL || total == 0)
+        {
+            // Mappings first, so that a failure leaves the run whole.
+            std::vector<Pointer> own;
+            try
+            {
+                for (size_t k = 0; k < sizes.size(); k++)
+                {
+                    if (use_mapping(sizes[k], block_align))
+                        own.push_back(alloc_block(sizes[k], block_align));
+                }
+            }
+            catch (AllocError &)
+            {
+                for (size_t k = 0; k < own.size(); k++)
+                    release_block(own[k].get_id());
+                if (run != NULL)
+                    add_block_free(run, block_size(run));
+                throw;
+            }
+
+            // Cut the run into the blocks; the last one keeps any slack.
+            size_t slack = run ? block_size(run) - total : 0;
+            size_t prev_free = run ? run->size & PrevFree : 0;
+            int8_t *at = reinterpret_cast<int8_t*>(run);
+            size_t mapped = 0;
+            for (size_t k = 0; k < sizes.size(); k++)
+            {
+                if (use_mapping(sizes[k], block_align))
+                {
+                    out.push_back(own[mapped++]);
+                    continue;
+                }
+
+                BlockHeader *block = reinterpret_cast<BlockHeader*>(at);
+                size_t b_size = fit_size(sizes[k]);
+                if (k == run_last)
+                    b_size += slack;
+                block->size = b_size | (at == reinterpret_cast<int8_t*>(run) ? prev_free : 0);
+
+                int id = add_handle(at + header_size, sizes[k]);
+                set_owner(block, id);
+                set_bin(id, b_size);
+                out.push_back(Pointer(base, seg_of(id), id));
+                at += b_size;
+            }
+        }
+        else
+        {
+            // No run holds them all: a block each, released again on failure.
+            try
+            {
+                for (size_t k = 0; k < sizes.size(); k++)
+                    out.push_back(alloc_block(sizes[k], block_align));
+            }
+            catch (AllocError &)
+            {
+                for (size_t k = 0; k < out.size(); k++)
+                    release_block(out[k].get_id());
+                out.clear();
+                throw;
+            }
+        }
+        ops.allocs += sizes.size();
+    }
+
+    if (track_latency)
+        note_latency(OpAlloc, start);
+    if (trace != NULL)
+    {
+        for (size_t k = 0; k < out.size(); k++)
+            trace_event(TraceAlloc, out[k].get_id(), sizes[k]);
+    }
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::free_batch(std::vector<Pointer> &pointers)
+{
+    uint64_t start = track_latency ? now_ns() : 0;
+
+    std::vector<int> ids;
+    ids.reserve(pointers.size());
+    for (size_t k = 0; k < pointers.size(); k++)
+    {
+        int id = pointers[k].get_id();
+        if (id == -1)
+            continue;
+        if (trace != NULL)
+            trace_event(TraceFree, id, 0);
+        ids.push_back(id);
+        pointers[k].set_null();
+    }
+
+    {
+        ArenaLock guard(this);
+
+        // Headers are found under the lock, where the compactor can't be
+        // moving the blocks. Blocks mapped on their own may happen to be
+        // neighbours too, but never merge.
+        std::vector<BlockHeader*> blocks;
+        blocks.reserve(ids.size());
+        size_t mapped = 0;
+        for (size_t k = 0; k < ids.size(); k++)
+        {
+            if (h_flags(ids[k]) & HandleMapped)
+            {
+                release_mapped(ids[k]);
+                mapped++;
+            }
+            else
+            {
+                blocks.push_back(header_of(payload(ids[k])));
+            }
+        }
+        std::sort(blocks.begin(), blocks.end());
+        ops.frees += blocks.size() + mapped;
+
+        for (size_t k = 0; k < blocks.size(); )
+        {
+            BlockHeader *run = blocks[k];
+            size_t run_size = block_size(run);
+            del_handle(owner(run));
+
+            while (++k < blocks.size() && reinterpret_cast<int8_t*>(blocks[k]) ==
+                                          reinterpret_cast<int8_t*>(run) + run_size)
+            {
+                run_size += block_size(blocks[k]);
+                del_handle(owner(blocks[k]));
+                block_merged(blocks[k], run);
+            }
+            add_block_free(run, run_size);
+        }
+    }
+
+    if (track_latency)
+        note_latency(OpFree, start);
+}
+
+template <class Placement>
+void *BasicAllocator<Placement>::alloc_pinned(size_t N, size_t alignment)
+{
+    Pointer p = alloc_traced(N, alignment, true);
+    p.pin();
+    return p.get();
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::free_pinned(void *raw)
+{
+    Pointer p = handle_of(raw);
+    p.unpin();
+    free(p);
+}
+
+template <class Placement>
+Pointer BasicAllocator<Placement>::handle_of(void *raw)
+{
+    int id = owner(header_of(reinterpret_cast<int8_t*>(raw)));
+    return Pointer(base, seg_of(id), id);
+}
+
+template <class Placement>
+Pointer BasicAllocator<Placement>::restore(int id)
+{
+    ArenaLock guard(this);
+    if (id < 0 || id >= handle_count || !(h_flags(id) & HandleLive))
+        return Pointer();
+    return Pointer(base, seg_of(id), id);
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::set_root(const Pointer &p)
+{
+    if (file == NULL)
+        throw AllocError(InvalidArena, "set_root() needs a file-backed arena");
+    file->root = p.get_id();
+}
+
+template <class Placement>
+Pointer BasicAllocator<Placement>::root()
+{
+    return file != NULL ? restore((int) file->root) : Pointer();
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::release_block(int id)
+{
+    if (h_flags(id) & HandleMapped)
+    {
+        release_mapped(id);
+        return;
+    }
+
+    BlockHeader *block = header_of(payload(id));
+    
+    del_handle(id);
+    add_block_free(block, block_size(block));
+}
+
+static std::atomic<int> next_cache_slot(0);
+
+static std::atomic<bool> epoch_slots[max_epoch_threads];
+
+// A thread's epoch slot, given back by its thread_local destructor.
+struct EpochSlot {
+    int slot;
+
+    EpochSlot() : slot(-1)
+    {
+        for (int t = 0; t < max_epoch_threads && slot < 0; t++)
+        {
+            bool taken = false;
+            if (epoch_slots[t].compare_exchange_strong(taken, true))
+                slot = t;
+        }
+    }
+
+    ~EpochSlot()
+    {
+        if (slot >= 0)
+            epoch_slots[slot].store(false);
+    }
+};
+
+int epoch_thread()
+{
+    static thread_local EpochSlot mine;
+    if (mine.slot < 0)
+        throw AllocError(NoMemory, "epoch_thread(): too many threads");
+    return mine.slot;
+}
+
+template <class Placement>
+int BasicAllocator<Placement>::my_cache()
+{
+    static thread_local int slot = next_cache_slot++ % max_thread_caches;
+    return slot;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::remote_push(ThreadCache &owner, int c, int id)
+{
+    // Counted first, so that the count never drops below the list length.
+    owner.remote_count.fetch_add(1, std::memory_order_relaxed);
+
+    std::atomic<uint64_t> &head = owner.remote[c];
+    uint64_t old = head.load(std::memory_order_relaxed);
+    uint64_t now;
+    do
+    {
+        h_size(id) = (uint32_t) old;
+        now = ((old >> 32) + 1) << 32 | (uint32_t) id;
+    }
+    while (!head.compare_exchange_weak(old, now, std::memory_order_release,
+                                       std::memory_order_relaxed));
+}
+
+template <class Placement>
+int BasicAllocator<Placement>::remote_take(ThreadCache &cache, int c)
+{
+    // Returns the first id of the whole list, linked through h_size(), or -1.
+    std::atomic<uint64_t> &head = cache.remote[c];
+    uint64_t old = head.load(std::memory_order_relaxed);
+    while ((uint32_t) old != remote_end &&
+           !head.compare_exchange_weak(old, ((old >> 32) + 1) << 32 | remote_end,
+                                       std::memory_order_acquire, std::memory_order_relaxed))
+        ;
+    return (uint32_t) old == remote_end ? -1 : (int) (uint32_t) old;
+}
+
+template <class Placement>
+int BasicAllocator<Placement>::carve_batch(size_t b_size, int *out, int n)
+{
+    int k = 0;
+    while (k < n)
+    {
+        FreeBlock *fit = find_fit(b_size);
+        if (fit == NULL)
+            break;
+
+        BlockHeader *block = take_block(fit, b_size);
+        int id = add_handle(reinterpret_cast<int8_t*>(block) + header_size, 0);
+        h_flags(id) = (b_size / block_align) << bin_shift;
+        set_owner(block, id);
+        out[k++] = id;
+    }
+    return k;
+}
+
+template <class Placement>
+bool BasicAllocator<Placement>::cache_alloc(size_t N, Pointer &p)
+{
+    size_t b_size = fit_size(N);
+    if (b_size > cache_max_block)
+        return false;
+
+    int c = b_size / block_align;
+    int slot = my_cache();
+    ThreadCache &cache = caches[slot];
+
+    int id = -1;
+    {
+        std::lock_guard<std::mutex> g(cache.lock);
+        if (cache.count[c] > 0)
+        {
+            id = cache.bins[c][--cache.count[c]];
+            cache.allocs++;
+        }
+    }
+
+    // Blocks other threads freed back to this cache come before the arena.
+    int next = id == -1 ? remote_take(cache, c) : -1;
+    if (next != -1)
+    {
+        int taken = 0;
+        {
+            std::lock_guard<std::mutex> g(cache.lock);
+            while (next != -1 && (id == -1 || cache.count[c] < cache_depth))
+            {
+                if (id == -1)
+                    id = next;
+                else
+                    cache.bins[c][cache.count[c]++] = next;
+                next = (int) (uint32_t) h_size(next);
+                taken++;
+            }
+            cache.frees += taken;
+            cache.remote_frees += taken;
+            cache.allocs++;
+        }
+
+        // More than the bin holds: the rest goes back to the arena.
+        int spilled = 0;
+        if (next != -1)
+        {
+            ArenaLock guard(this);
+            while (next != -1)
+            {
+                int k = next;
+                next = (int) (uint32_t) h_size(k);
+                release_block(k);
+                spilled++;
+            }
+            std::lock_guard<std::mutex> g(cache.lock);
+            cache.frees += spilled;
+            cache.remote_frees += spilled;
+        }
+        cache.remote_count.fetch_sub(taken + spilled, std::memory_order_relaxed);
+    }
+
+    if (id == -1)
+    {
+        // Refill: carve a batch under one arena lock, keep one, cache the rest.
+        int batch[cache_batch];
+        int n;
+        {
+            ArenaLock guard(this);
+            n = carve_batch(b_size, batch, cache_batch);
+        }
+        if (n == 0)
+            return false;
+
+        id = batch[--n];
+        {
+            std::lock_guard<std::mutex> g(cache.lock);
+            while (n > 0 && cache.count[c] < cache_depth)
+                cache.bins[c][cache.count[c]++] = batch[--n];
+            cache.allocs++;
+        }
+
+        // Another thread sharing this cache may have filled the bin.
+        if (n > 0)
+        {
+            ArenaLock guard(this);
+            while (n > 0)
+                release_block(batch[--n]);
+        }
+    }
+
+    h_size(id) = N;
+    h_cache(id) = slot + 1;
+    __atomic_store_n(&h_flags(id), HandleLive | (c << bin_shift), __ATOMIC_RELEASE);
+    p = Pointer(base, seg_of(id), id);
+    return true;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::set_bin(int id, size_t b_size)
+{
+    // The bin is read by cache_free() without the arena lock, so it is kept
+    // in the handle rather than read back from the block header.
+    uint32_t bin = (caches != NULL && b_size <= cache_max_block) ?
+                   b_size / block_align : 0;
+    h_flags(id) = (h_flags(id) & ~bin_mask) | (bin << bin_shift);
+}
+
+template <class Placement>
+bool BasicAllocator<Placement>::cache_free(int id)
 {
-    int i = 0;
-    bool found = false;
-    while (!found && i < max_ptrs)
+    // The compactor may be moving the block, which can change its bin.
+    int c;
+    while (true)
     {
-        if (blocks_used[i] == NULL)
-        {
-            found = true;
-        }
-        else
-        {
-            i++;
-        }
+        uint32_t f = settled_flags(id);
+        c = (f & bin_mask) >> bin_shift;
+        if (c == 0)
+            return false;
+        if (__atomic_compare_exchange_n(&h_flags(id), &f, c << bin_shift, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
     }
 
-    if (found) 
+    // Another thread's block goes back to its cache.
+    int slot = my_cache();
+    int owner = h_cache(id) - 1;
+    if (owner >= 0 && owner != slot)
     {
-        blocks_used[i] = block;
-        return i;
+        remote_push(caches[owner], c, id);
+        return true;
     }
-    else
-        throw AllocError(NoMemory, "Maximum pointers reached");
-    return -1;
-}
 
-int Allocator::add_block_free(Memblock *block)
-{
+    ThreadCache &cache = caches[slot];
 
-    int j = 0;
-    while (j < max_ptrs)
+    // Drain: a full bin hands its oldest batch back to the arena.
+    int spill[cache_batch];
+    int n = 0;
     {
-        if (blocks_free[j] != NULL && 
-            blocks_free[j]->get_end() == block->get_start() - 1)
+        std::lock_guard<std::mutex> g(cache.lock);
+        if (cache.count[c] == cache_depth)
         {
-            block->shift_start(blocks_free[j]->get_start());
-            del_block_free(j);
-            return add_block_free(block);
-        }
-        
-        else if (blocks_free[j] != NULL &&
-                 blocks_free[j]->get_start() == block->get_end() + 1)
-        {
-            block->shift_end(blocks_free[j]->get_end());
-            del_block_free(j);
-            return add_block_free(block);
+            int *bin = cache.bins[c];
+            for (n = 0; n < cache_batch; n++)
+                spill[n] = bin[n];
+            for (int k = cache_batch; k < cache_depth; k++)
+                bin[k - cache_batch] = bin[k];
+            cache.count[c] -= cache_batch;
         }
+        cache.bins[c][cache.count[c]++] = id;
+        cache.frees++;
+    }
 
-        j++;
+    if (n > 0)
+    {
+        ArenaLock guard(this);
+        while (n > 0)
+            release_block(spill[--n]);
     }
-    
-    int i = 0;
-    bool found = false;
-    while (!found && i < max_ptrs)
+    return true;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::flush_caches()
+{
+    // Called with arena_lock held. Cache hits never wait for the arena lock
+    // while holding a cache lock, so taking them in this order is safe.
+    for (int t = 0; t < max_thread_caches; t++)
     {
-        if (blocks_free[i] == NULL)
-        {
-            found = true;
-        }
-        else
+        ThreadCache &cache = caches[t];
+        std::lock_guard<std::mutex> g(cache.lock);
+        for (int c = 0; c < cache_classes; c++)
         {
-            i++;
+            while (cache.count[c] > 0)
+                release_block(cache.bins[c][--cache.count[c]]);
+
+            int taken = 0;
+            for (int k = remote_take(cache, c); k != -1; taken++)
+            {
+                int next = (int) (uint32_t) h_size(k);
+                release_block(k);
+                k = next;
+            }
+            cache.frees += taken;
+            cache.remote_frees += taken;
+            cache.remote_count.fetch_sub(taken, std::memory_order_relaxed);
         }
     }
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::realloc(Pointer &p, size_t N)
+{
+    bool fresh = p.get_id() == -1;
 
-    if (found) 
+    if (!track_latency)
     {
-        blocks_free[i] = block;
-        return i;
+        realloc_any(p, N);
     }
     else
-        throw AllocError(NoMemory, "Maximum pointers reached");
-    return -1;
+    {
+        uint64_t start = now_ns();
+        realloc_any(p, N);
+        note_latency(OpRealloc, start);
+    }
+
+    if (trace != NULL)
+        trace_event(fresh ? TraceAlloc : TraceRealloc, p.get_id(), N);
 }
 
-Pointer Allocator::alloc(size_t N)
+template <class Placement>
+void BasicAllocator<Placement>::realloc_any(Pointer &p, size_t N)
 {
-    Pointer pointer;
+    int i = p.get_id();
+    
+    if (i == -1)
+    {
+        p = alloc_any(N, block_align);
+        return;
+    }
 
-    int i = 0;
-    bool found = false;
-    while (!found && i < max_ptrs)
+    ArenaLock guard(this);
+    ops.reallocs++;
+
+    if (h_flags(i) & HandleMapped)
     {
-        if (blocks_free[i] == NULL)
-        {
-            i++;
-            continue;
-        }
-            
-        if (blocks_free[i]->get_size() >= N)
-        {
-            found = true;
-        }
-        else
+        realloc_mapped(i, N);
+        return;
+    }
+
+    int8_t *p_start = payload(i);
+    size_t p_size = h_size(i);
+    
+    if (p_size == N)
+        return;
+
+    BlockHeader *block = header_of(p_start);
+    size_t b_old = block_size(block);
+    size_t b_new = fit_size(N);
+
+    if (b_new <= b_old)
+    {
+        if (b_old - b_new >= min_block)
         {
-            i++;
+            set_used(block, b_new);
+            BlockHeader *rest = next_block(block);
+            rest->size = 0;
+            add_block_free(rest, b_old - b_new);
         }
+
+        h_size(i) = N;
+        set_bin(i, block_size(block));
+        return;
     }
+
+    BlockHeader *next = next_block(block);
     
-    if (found)
+    if ((next->size & BlockFree) && b_old + block_size(next) >= b_new)
     {
-        size_t size_old = blocks_free[i]->get_size();
-        int8_t *start_old = blocks_free[i]->get_start();
+        remove_free(static_cast<FreeBlock*>(next));
+        block_merged(next, block);
+        split_block(block, b_old + block_size(next), b_new);
+        h_size(i) = N;
+        set_bin(i, block_size(block));
+        return;
+    }
         
-        if (size_old == N)
-        {
-            del_block_free(i);
-        }
-        else
+    // A free block right before this one (together with a free block right
+    // after it) may be enough: slide the data down and grow over both.
+    if (block->size & PrevFree)
+    {
+        BlockHeader *prev = prev_block(block);
+        bool with_next = (next->size & BlockFree) != 0;
+        size_t total = block_size(prev) + b_old;
+        if (with_next)
+            total += block_size(next);
+
+        int8_t *start_new = reinterpret_cast<int8_t*>(prev) + header_size;
+        if (total >= b_new &&
+            (reinterpret_cast<uintptr_t>(start_new) & (align_of(i) - 1)) == 0)
         {
-            int8_t *start_new = start_old + N;
-            blocks_free[i]->shift_start(start_new);
+            remove_free(static_cast<FreeBlock*>(prev));
+            if (with_next)
+                remove_free(static_cast<FreeBlock*>(next));
+            block_merged(block, prev);
+            if (with_next)
+                block_merged(next, prev);
+
+            memmove(start_new, p_start, p_size);
+            ops.realloc_moves++;
+            split_block(prev, total, b_new);
+
+            set_owner(prev, i);
+            h_offset(i) = offset_of(start_new);
+            h_size(i) = N;
+            set_bin(i, block_size(prev));
+            return;
         }
- 
-        Memblock *block = new Memblock(start_old, N);
-        int i = add_block_used(block);
-        pointer = Pointer(&blocks_used[i], i);
     }
-    else
+        
+    // Grown past the threshold: this copy is the last one, later growth
+    // is an mremap().
+    if (use_mapping(N, align_of(i)))
     {
-        throw AllocError(NoMemory, "alloc()");
+        int8_t *start_new = map_block(N);
+        memcpy(start_new, p_start, p_size);
+        ops.realloc_moves++;
+
+        h_flags(i) = (h_flags(i) & ~bin_mask) | HandleMapped;
+        set_owner(header_of(start_new), i);
+        h_offset(i) = offset_of(start_new);
+        h_size(i) = N;
+        add_block_free(block, b_old);
+        return;
     }
 
-    return pointer;
+    BlockHeader *moved = take_fit(b_new, align_of(i));
+    
+    if (moved == NULL)
+        throw AllocError(NoMemory, "realloc()");
+
+    int8_t *start_new = reinterpret_cast<int8_t*>(moved) + header_size;
+
+    memcpy(start_new, p_start, p_size);
+    ops.realloc_moves++;
+
+    set_owner(moved, i);
+    h_offset(i) = offset_of(start_new);
+    h_size(i) = N;
+    set_bin(i, block_size(moved));
+
+    add_block_free(block, b_old);
 }
-        
-void Allocator::free(Pointer &p) 
-{
-    int i = p.get_id();
 
-    int8_t *p_start = blocks_used[i]->get_start();
-    size_t p_size = blocks_used[i]->get_size();
-    int8_t *p_end = blocks_used[i]->get_end();
-    
-    del_block_used(i);
+template <class Placement>
+int8_t *BasicAllocator<Placement>::map_block(size_t N)
+{
+    // The header at the start of the mapping holds its length and owner,
+    // like an arena block's, so handle_of() works on it too.
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (N > ~(size_t) 0 / 2)
+        throw AllocError(NoMemory, "mmap()");
+    size_t bytes = (header_size + N + page - 1) & ~(page - 1);
 
-    Memblock *block = new Memblock(p_start, p_size);
-    add_block_free(block);
+    void *at = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (at == MAP_FAILED)
+        throw AllocError(NoMemory, "mmap()");
 
-    p.set_null();
-} 
+    BlockHeader *b = static_cast<BlockHeader*>(at);
+    b->size = bytes;
+    ops.mapped_blocks++;
+    ops.mapped_bytes += bytes;
+    return reinterpret_cast<int8_t*>(b) + header_size;
+}
 
-void Allocator::realloc(Pointer &p, size_t N)
+template <class Placement>
+void BasicAllocator<Placement>::realloc_mapped(int id, size_t N)
 {
-    int i = p.get_id();
-    
-    if (i == -1)
+    int8_t *p_start = payload(id);
+    BlockHeader *b = header_of(p_start);
+    size_t bytes = block_size(b);
+
+    // Shrunk below the threshold: back into the arena.
+    if (!use_mapping(N, block_align))
     {
-        p = alloc(N);
+        BlockHeader *moved = take_fit(fit_size(N), block_align);
+        if (moved == NULL)
+            throw AllocError(NoMemory, "realloc()");
+
+        int8_t *start_new = reinterpret_cast<int8_t*>(moved) + header_size;
+        memcpy(start_new, p_start, std::min(N, h_size(id)));
+        ops.realloc_moves++;
+
+        munmap(b, bytes);
+        ops.mapped_blocks--;
+        ops.mapped_bytes -= bytes;
+
+        h_flags(id) &= ~(bin_mask | HandleMapped);
+        set_owner(moved, id);
+        h_offset(id) = offset_of(start_new);
+        h_size(id) = N;
+        set_bin(id, block_size(moved));
         return;
     }
 
-    int8_t *p_start = blocks_used[i]->get_start();
-    size_t p_size = blocks_used[i]->get_size();
-    int8_t *p_end = blocks_used[i]->get_end();
-    
-    if (p_size == N)
-        return;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t want = (header_size + N + page - 1) & ~(page - 1);
+    if (want != bytes)
+    {
+        // The kernel moves the pages, if it has to, by editing page tables.
+        void *at = mremap(b, bytes, want, MREMAP_MAYMOVE);
+        if (at == MAP_FAILED)
+            throw AllocError(NoMemory, "mremap()");
+
+        b = static_cast<BlockHeader*>(at);
+        b->size = want;
+        h_offset(id) = offset_of(reinterpret_cast<int8_t*>(b) + header_size);
+        ops.mremaps++;
+        ops.mapped_bytes += want - bytes;
+    }
+    h_size(id) = N;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::release_mapped(int id)
+{
+    BlockHeader *b = header_of(payload(id));
+    size_t bytes = block_size(b);
+    del_handle(id);
+    munmap(b, bytes);
+    ops.mapped_blocks--;
+    ops.mapped_bytes -= bytes;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::reset_free_lists()
+{
+    free_bytes = 0;
+    free_blocks = 0;
+    fl_bitmap = 0;
+    for (int fl = 0; fl < fl_count; fl++)
+    {
+        sl_bitmap[fl] = 0;
+        for (int sl = 0; sl < sl_count; sl++)
+            free_lists[fl][sl] = NULL;
+    }
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::defrag()
+{
+    // Slide every used block down over the free space before it in one
+    // address-ordered pass. Pinned blocks stay put: the space left in front
+    // of one becomes a free block and sliding resumes right after it.
+    if (trace != NULL)
+        trace_event(TraceDefrag, -1, 0);
 
-    if (p_size > N)
+    ArenaLock guard(this);
+    if (caches != NULL)
+        flush_caches();
+    reclaim_retired(true);
+
+    reset_free_lists();
+    compact_cursor = NULL;
+    placement.reset();
+    ops.defrags++;
+
+    // Aligned blocks may land above dst; the space skipped is closed like
+    // the space in front of a pinned block.
+    int8_t *dst = reinterpret_cast<int8_t*>(first);
+    BlockHeader *placed = NULL;     // last used block at its final place
+    BlockHeader *b = first;
+    while (b != last)
     {
-        size_t size_delta = p_size - N;
-        blocks_used[i]->shift_end(p_end - size_delta);
+        size_t b_size = block_size(b);
+        BlockHeader *next = next_block(b);
+
+        if (!(b->size & BlockFree))
+        {
+            int id = owner(b);
+            BlockHeader *to = b;
+            if (!pinned(id))
+            {
+                int8_t *at = dst;
+                if (align_of(id) > block_align)
+                    at = aligned_spot(dst, align_of(id));
+                if (at < reinterpret_cast<int8_t*>(b))
+                {
+                    move_down(at, b, header_size + h_size(id));
+                    ops.defrag_moved_bytes += header_size + h_size(id);
+                    to = reinterpret_cast<BlockHeader*>(at);
+                    to->size = b_size;
+                    h_offset(id) = at + header_size - base;
+                }
+            }
 
-        Memblock *block = new Memblock(p_end-size_delta+1, size_delta);
-        add_block_free(block);
+            close_gap(dst, to, placed);
+            placed = to;
+            dst = reinterpret_cast<int8_t*>(to) + b_size;
+        }
+
+        b = next;
+    }
+
+    close_gap(dst, last, placed);
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::close_gap(int8_t *dst, BlockHeader *block, BlockHeader *placed)
+{
+    size_t bytes = reinterpret_cast<int8_t*>(block) - dst;
+    if (bytes < min_block && placed != NULL)
+    {
+        // Too small for a free block: the block placed before pads over it.
+        placed->size += bytes;
+        set_bin(owner(placed), block_size(placed));
+        bytes = 0;
+    }
+    if (bytes == 0)
+    {
+        block->size &= ~(size_t) PrevFree;
         return;
     }
 
-    size_t size_delta = N - p_size;
+    BlockHeader *gap = reinterpret_cast<BlockHeader*>(dst);
+    gap->size = 0;
+    set_free(gap, reinterpret_cast<int8_t*>(block) - dst);
+    insert_free(static_cast<FreeBlock*>(gap));
+    if (reserved != 0)
+        release_chunks(dst + sizeof(FreeBlock), reinterpret_cast<int8_t*>(block) - sizeof(size_t));
+}
+
+template <class Placement>
+bool BasicAllocator<Placement>::defrag_step(size_t max_bytes, uint64_t max_ns)
+{
+    if (trace != NULL)
+        trace_event(TraceDefragStep, -1, max_bytes);
+
+    ArenaLock guard(this);
+    reclaim_retired(true);
+
+    if (compact_cursor == NULL)
+    {
+        if (frag_ratio() <= defrag_threshold)
+            return true;
+        compact_cursor = first;
+    }
+
+    uint64_t deadline = max_ns ? now_ns() + max_ns : 0;
+    size_t spent = 0;
+    ops.defrag_steps++;
 
-    int j = 0;
-    bool found_next = false;
-    while (!found_next && j < max_ptrs)
+    while (true)
     {
-        if (blocks_free[j] != NULL &&
-            blocks_free[j]->get_start() == p_end + 1)
+        // Find the next hole; skipping used blocks counts as header reads,
+        // so a long run of them can use up the budget on its own.
+        BlockHeader *hole = compact_cursor;
+        while (hole != last && !(hole->size & BlockFree))
         {
-            found_next = true;
+            spent += header_size;
+            hole = next_block(hole);
+            if (spent >= max_bytes || (deadline && now_ns() >= deadline))
+            {
+                compact_cursor = hole;
+                return false;
+            }
         }
-        else
+
+        // Free neighbours are always coalesced, so a used block (or the
+        // sentinel) follows the hole.
+        BlockHeader *block = (hole != last) ? next_block(hole) : last;
+        if (block == last)
         {
-            j++;
+            compact_cursor = NULL;
+            return true;
         }
-    }
-    
-    if (found_next)
-    {
-        if (blocks_free[j]->get_size() > size_delta)
+
+        size_t hole_size = block_size(hole);
+        size_t b_size = block_size(block);
+        int id = owner(block);
+
+        // An aligned block may need a free gap in front of it; it stays put
+        // unless both the gap and the bytes it leaves behind form blocks.
+        size_t gap = 0;
+        if (align_of(id) > block_align)
+            gap = aligned_spot(reinterpret_cast<int8_t*>(hole), align_of(id)) -
+                  reinterpret_cast<int8_t*>(hole);
+
+        // Blocks parked in a thread cache are not live: one freed by another
+        // thread keeps its remote list link in the size slot, so it stays put.
+        if (pinned(id) || !(h_flags(id) & HandleLive) ||
+            (gap != 0 && (gap >= hole_size || hole_size - gap < min_block)))
         {
-            blocks_used[i]->shift_end(p_end + size_delta);
-            blocks_free[j]->shift_start(p_end + size_delta + 1);
-            return;
+            spent += header_size;
+            compact_cursor = next_block(block);
+            if (spent >= max_bytes || (deadline && now_ns() >= deadline))
+                return false;
+            continue;
         }
-        else if (blocks_free[j]->get_size() == size_delta)    
+
+        remove_free(static_cast<FreeBlock*>(hole));
+        BlockHeader *to = reinterpret_cast<BlockHeader*>(
+                reinterpret_cast<int8_t*>(hole) + gap);
+        move_down(to, block, header_size + h_size(id));
+        to->size = b_size;
+        h_offset(id) = reinterpret_cast<int8_t*>(to) + header_size - base;
+        if (gap != 0)
         {
-            blocks_used[i]->shift_end(p_end + size_delta);
-            del_block_free(j);
-            return;
-        } 
+            set_free(hole, gap);
+            insert_free(static_cast<FreeBlock*>(hole));
+        }
+
+        BlockHeader *rest = next_block(to);
+        rest->size = 0;
+        compact_cursor = rest;
+        block_merged(block, rest);
+        add_block_free(rest, hole_size - gap);
+
+        spent += header_size + h_size(id);
+        ops.defrag_moved_bytes += header_size + h_size(id);
+        if (spent >= max_bytes || (deadline && now_ns() >= deadline))
+            return false;
     }
-        
-    j = 0;
-    bool found = false;
-    while (!found && j < max_ptrs)
+}
+
+template <class Placement>
+uint32_t BasicAllocator<Placement>::settled_flags(int id)
+{
+    while (true)
+    {
+        uint32_t f = __atomic_load_n(&h_flags(id), __ATOMIC_ACQUIRE);
+        if (!(f & HandleMoving))
+            return f;
+        std::this_thread::yield();
+    }
+}
+
+template <class Placement>
+bool BasicAllocator<Placement>::evacuate_step(size_t max_bytes)
+{
+    // Like defrag_step(), but the block keeps its old copy for readers that
+    // still have its address: it moves into the hole in front of it only if
+    // the two don't overlap, and the old copy is retired rather than freed.
+    ArenaLock guard(this);
+    reclaim_retired(false);
+
+    if (compact_cursor == NULL)
+    {
+        if (frag_ratio() <= defrag_threshold || merges == idle_merges)
+            return true;
+        compact_cursor = first;
+        round_moved = 0;
+    }
+
+    size_t spent = 0;
+    ops.defrag_steps++;
+
+    while (true)
     {
-        if (blocks_free[j] != NULL &&
-            blocks_free[j]->get_size() >= N)
+        BlockHeader *hole = compact_cursor;
+        while (hole != last && !(hole->size & BlockFree))
         {
-            found = true;
+            spent += header_size;
+            hole = next_block(hole);
+            if (spent >= max_bytes)
+            {
+                compact_cursor = hole;
+                return false;
+            }
         }
-        else
+
+        BlockHeader *block = (hole != last) ? next_block(hole) : last;
+        if (block == last)
+        {
+            if (round_moved == 0)
+                idle_merges = merges;
+            compact_cursor = NULL;
+            return true;
+        }
+
+        size_t b_size = block_size(block);
+        int8_t *from = reinterpret_cast<int8_t*>(block) + header_size;
+        int id = owner(block);
+
+        // Cached blocks (not live), pinned blocks and retired copies (the
+        // handle has moved on) stay where they are.
+        uint32_t f = __atomic_load_n(&h_flags(id), __ATOMIC_ACQUIRE);
+        uint32_t k = (f & align_mask) >> align_shift;
+        size_t align = k ? (size_t) 1 << k : block_align;
+        size_t gap = 0;
+        if (align > block_align)
+            gap = aligned_spot(reinterpret_cast<int8_t*>(hole), align) -
+                  reinterpret_cast<int8_t*>(hole);
+
+        if (!(f & HandleLive) || f >= pin_one || h_offset(id) != (size_t) (from - base) ||
+            gap + b_size > block_size(hole) ||
+            !__atomic_compare_exchange_n(&h_flags(id), &f, f | HandleMoving, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
         {
-            j++;
+            spent += header_size;
+            compact_cursor = next_block(block);
+            if (spent >= max_bytes)
+                return false;
+            continue;
         }
+
+        FreeBlock *fit = static_cast<FreeBlock*>(hole);
+        BlockHeader *to = align > block_align ? take_aligned(fit, b_size, align) :
+                                                take_block(fit, b_size);
+        move_down(reinterpret_cast<int8_t*>(to) + header_size, from, h_size(id));
+        to->handle = block->handle;
+        __atomic_store_n(&h_offset(id), reinterpret_cast<int8_t*>(to) + header_size - base,
+                         __ATOMIC_SEQ_CST);
+
+        // The block may have grown by the tail of the hole; pins taken
+        // meanwhile are kept.
+        uint32_t bin = (block_size(to) <= cache_max_block) ? block_size(to) / block_align : 0;
+        uint32_t moving = f | HandleMoving;
+        while (!__atomic_compare_exchange_n(&h_flags(id), &moving,
+                                            (moving & ~(HandleMoving | bin_mask)) | (bin << bin_shift),
+                                            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            ;
+
+        Retired r = { block, epoch_domain.advance() };
+        retired.push_back(r);
+        compact_cursor = next_block(to);
+
+        spent += header_size + h_size(id);
+        round_moved += header_size + h_size(id);
+        ops.defrag_moved_bytes += header_size + h_size(id);
+        if (spent >= max_bytes)
+            return false;
     }
-    
-    if (!found)
-        throw AllocError(NoMemory, "realloc()");
-    
-    int8_t *start_new = blocks_free[j]->get_start();
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::reclaim_retired(bool all)
+{
+    if (retired.empty())
+        return;
 
-    for (int k = 0; k < p_size; k++)
+    uint64_t oldest = all ? ~(uint64_t) 0 : epoch_domain.oldest();
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); i++)
     {
-        start_new[k] = p_start[k];
+        if (retired[i].epoch < oldest)
+            add_block_free(retired[i].block, block_size(retired[i].block));
+        else
+            retired[kept++] = retired[i];
     }
+    retired.resize(kept);
+}
 
-    Memblock *block = new Memblock(start_new, N);
-    
-    if (blocks_free[j]->get_size() == N)
+template <class Placement>
+void BasicAllocator<Placement>::compactor_loop(uint64_t period_us, size_t step_bytes)
+{
+    std::unique_lock<std::mutex> g(compactor_lock);
+    while (!compactor_stop)
     {
-       del_block_free(j);
+        g.unlock();
+        bool idle = evacuate_step(step_bytes);
+        if (!idle)
+            std::this_thread::yield();  // let threads waiting on arena_lock in
+        g.lock();
+        if (idle)
+            compactor_wake.wait_for(g, std::chrono::microseconds(period_us));
     }
-    else
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::start_compactor(uint64_t period_us, size_t step_bytes)
+{
+    if (caches == NULL)
+        throw AllocError(InvalidArena, "start_compactor() needs a concurrent arena");
+    if (compactor.joinable())
+        return;
+
+    compactor_stop = false;
+    compactor = std::thread(&BasicAllocator::compactor_loop, this, period_us, step_bytes);
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::stop_compactor()
+{
+    if (!compactor.joinable())
+        return;
+
     {
-        blocks_free[j]->shift_start(start_new + N);
+        std::lock_guard<std::mutex> g(compactor_lock);
+        compactor_stop = true;
     }
+    compactor_wake.notify_all();
+    compactor.join();
+}
 
-    del_block_used(i);
-    
-    Memblock *free_block = new Memblock(p_start, p_size);
-    add_block_free(free_block);
-    
-    blocks_used[i] = block;
+template <class Placement>
+size_t BasicAllocator<Placement>::largest_free()
+{
+    if (fl_bitmap == 0)
+        return 0;
+
+    int fl = msb(fl_bitmap);
+    int sl = msb(sl_bitmap[fl]);
+
+    size_t largest = 0;
+    for (FreeBlock *block = free_lists[fl][sl]; block; block = block->next_free)
+    {
+        if (block_size(block) > largest)
+            largest = block_size(block);
+    }
+    return largest;
+}
+
+template <class Placement>
+double BasicAllocator<Placement>::frag_ratio()
+{
+    if (free_bytes == 0)
+        return 0;
+    return 1.0 - (double) largest_free() / free_bytes;
+}
+
+template <class Placement>
+double BasicAllocator<Placement>::fragmentation()
+{
+    ArenaLock guard(this);
+    return frag_ratio();
+}
+
+template <class Placement>
+bool BasicAllocator<Placement>::needs_defrag()
+{
+    return fragmentation() > defrag_threshold;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::note_latency(AllocOp op, uint64_t start)
+{
+    uint64_t ns = now_ns() - start;
+    int k = ns ? msb(ns) : 0;
+    if (k >= latency_buckets)
+        k = latency_buckets - 1;
+    latency[op][k].fetch_add(1, std::memory_order_relaxed);
 }
 
-int Allocator::find_free_block(int8_t *b_start)
+template <class Placement>
+AllocStats BasicAllocator<Placement>::get_stats()
 {
-    int i = 0;
-    while (i < max_ptrs)
+    ArenaLock guard(this);
+
+    AllocStats st = ops;
+    st.arena_bytes = reinterpret_cast<int8_t*>(last) - reinterpret_cast<int8_t*>(first);
+    st.free_bytes = free_bytes;
+    st.used_bytes = st.arena_bytes - free_bytes;
+    st.largest_free = largest_free();
+    st.free_blocks = free_blocks;
+    st.fragmentation = frag_ratio();
+    st.cached_blocks = 0;
+    st.reserved_bytes = reserved;
+    st.chunk_bytes = chunk;
+    st.pages = pages;
+
+    for (int t = 0; caches != NULL && t < max_thread_caches; t++)
     {
-        if (blocks_free[i] != NULL &&
-            blocks_free[i]->get_end() == b_start-1)
-        {
-            return i;
-        }
-        i++;
+        ThreadCache &cache = caches[t];
+        std::lock_guard<std::mutex> g(cache.lock);
+        for (int c = 0; c < cache_classes; c++)
+            st.cached_blocks += cache.count[c];
+        st.allocs += cache.allocs;
+        st.frees += cache.frees;
+
+        // Blocks on remote lists count as freed and cached.
+        int remote = cache.remote_count.load(std::memory_order_relaxed);
+        st.cached_blocks += remote;
+        st.frees += remote;
+        st.remote_frees += cache.remote_frees + remote;
     }
 
-    return -1;
+    st.live_handles = handle_count - free_handles.size() - st.cached_blocks;
+    return st;
 }
 
-void Allocator::shift_block_used(int id, int8_t *new_start)
+static void json_latency(std::string &out, const char *name,
+                         const std::atomic<uint64_t> *buckets)
 {
-    int8_t *b_start = blocks_used[id]->get_start();
-    size_t b_size = blocks_used[id]->get_size();
-    int8_t *b_end = blocks_used[id]->get_end();
+    uint64_t counts[latency_buckets];
+    uint64_t total = 0;
+    int used = 0;
+    for (int k = 0; k < latency_buckets; k++)
+    {
+        counts[k] = buckets[k].load(std::memory_order_relaxed);
+        total += counts[k];
+        if (counts[k] != 0)
+            used = k + 1;
+    }
 
-    for (int i = 0; i < b_size; i++)
+    // Percentiles are reported as the upper bound of their bucket.
+    uint64_t p50 = 0, p99 = 0, seen = 0;
+    for (int k = 0; k < used; k++)
     {
-        new_start[i] = b_start[i];
+        seen += counts[k];
+        if (p50 == 0 && seen * 100 >= total * 50)
+            p50 = 2ULL << k;
+        if (p99 == 0 && seen * 100 >= total * 99)
+            p99 = 2ULL << k;
     }
-    
-    blocks_used[id]->shift_start(new_start);
-    blocks_used[id]->shift_end(b_end - b_start + new_start);
+
+    char line[128];
+    snprintf(line, sizeof(line), "\"%s\":{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"buckets\":[",
+             name, (unsigned long long) total, (unsigned long long) p50,
+             (unsigned long long) p99);
+    out += line;
+    for (int k = 0; k < used; k++)
+    {
+        snprintf(line, sizeof(line), k ? ",%llu" : "%llu", (unsigned long long) counts[k]);
+        out += line;
+    }
+    out += "]}";
 }
 
-void Allocator::shift_block_free(int id, int8_t *new_start)
-{   
-    blocks_free[id]->shift_start(new_start);
+template <class Placement>
+std::string BasicAllocator<Placement>::dump()
+{
+    AllocStats st = get_stats();
+
+    char text[1024];
+    snprintf(text, sizeof(text),
+             "{\"placement\":\"%s\",\"arena_bytes\":%zu,\"used_bytes\":%zu,\"free_bytes\":%zu,"
+             "\"largest_free\":%zu,\"free_blocks\":%zu,\"fragmentation\":%.6f,"
+             "\"live_handles\":%zu,\"cached_blocks\":%zu,\"reserved_bytes\":%zu,"
+             "\"chunk_bytes\":%zu,\"pages\":\"%s\",\"mapped_blocks\":%zu,\"mapped_bytes\":%zu,"
+             "\"ops\":{\"alloc\":%llu,\"free\":%llu,\"realloc\":%llu,"
+             "\"realloc_moves\":%llu,\"defrag\":%llu,\"defrag_steps\":%llu,"
+             "\"defrag_moved_bytes\":%llu,\"arena_grows\":%llu,\"released_bytes\":%llu,"
+             "\"mremaps\":%llu,\"remote_frees\":%llu},"
+             "\"latency_ns\":{",
+             Placement::name(), st.arena_bytes, st.used_bytes, st.free_bytes,
+             st.largest_free, st.free_blocks, st.fragmentation,
+             st.live_handles, st.cached_blocks, st.reserved_bytes, st.chunk_bytes,
+             st.pages == PagesHuge ? "huge" :
+             st.pages == PagesTransparent ? "transparent" : "default",
+             st.mapped_blocks, st.mapped_bytes,
+             (unsigned long long) st.allocs, (unsigned long long) st.frees,
+             (unsigned long long) st.reallocs, (unsigned long long) st.realloc_moves,
+             (unsigned long long) st.defrags, (unsigned long long) st.defrag_steps,
+             (unsigned long long) st.defrag_moved_bytes,
+             (unsigned long long) st.arena_grows, (unsigned long long) st.released_bytes,
+             (unsigned long long) st.mremaps, (unsigned long long) st.remote_frees);
+
+    std::string out = text;
+    json_latency(out, "alloc", latency[OpAlloc]);
+    out += ",";
+    json_latency(out, "free", latency[OpFree]);
+    out += ",";
+    json_latency(out, "realloc", latency[OpRealloc]);
+    out += "}}";
+    return out;
 }
-       
-void Allocator::defrag()
+
+static void put_varint(FILE *f, uint64_t v)
 {
-    int closest_id = -1, free_id = -1;
-    int8_t *free_start = NULL;
-    size_t free_size = 0;
-    int8_t *min_start = base + size + 1;
-    for (int i = 0; i < max_ptrs; i++)
+    while (v >= 0x80)
     {
-        if (blocks_used[i] == NULL)
-            continue;
+        putc((int) (v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    putc((int) v, f);
+}
 
-        int8_t *b_start = blocks_used[i]->get_start();
-        int j = find_free_block(b_start);
-        if (j != -1 && b_start < min_start)
-        {
-            closest_id = i;
-            free_id = j;
-            free_start = blocks_free[j]->get_start();
-            free_size = blocks_free[j]->get_size();
-            min_start = b_start;
-        }
-    }            
-    
-    if (closest_id == -1)
+static bool get_varint(FILE *f, uint64_t &v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int c = getc(f);
+        if (c == EOF)
+            return false;
+        v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+template <class Placement>
+bool BasicAllocator<Placement>::start_trace(const char *path)
+{
+    std::lock_guard<std::mutex> g(trace_lock);
+    if (trace != NULL)
+        fclose(trace.exchange(NULL));
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return false;
+
+    fwrite(&trace_magic, sizeof(trace_magic), 1, f);
+    trace = f;
+    return true;
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::stop_trace()
+{
+    std::lock_guard<std::mutex> g(trace_lock);
+    if (trace != NULL)
+        fclose(trace.exchange(NULL));
+}
+
+template <class Placement>
+void BasicAllocator<Placement>::trace_event(int op, int id, uint64_t size, uint64_t arg)
+{
+    std::lock_guard<std::mutex> g(trace_lock);
+    FILE *f = trace;
+    if (f == NULL)
         return;
 
-    shift_block_used(closest_id, free_start);
-    
-    del_block_free(free_id);
+    putc(op, f);
+    put_varint(f, (uint64_t) (id + 1));
+    put_varint(f, size);
+    if (op == TraceAlloc)
+        put_varint(f, arg);
+}
+
+bool read_trace_event(FILE *f, TraceEvent &ev)
+{
+    if (ftell(f) == 0)
+    {
+        uint32_t magic;
+        if (fread(&magic, sizeof(magic), 1, f) != 1 || magic != trace_magic)
+            return false;
+    }
 
-//    Memblock *block = new Memblock(min_start, free_size);
-    Memblock *block = new Memblock(blocks_used[closest_id]->get_end() + 1, free_size); 
-    add_block_free(block);        
+    int op = getc(f);
+    uint64_t id, size, arg = 0;
+    if (op == EOF || !get_varint(f, id) || !get_varint(f, size) ||
+        (op == TraceAlloc && !get_varint(f, arg)))
+        return false;
 
-    defrag();
+    ev.op = op;
+    ev.id = (int) id - 1;
+    ev.size = size;
+    ev.align = (arg >> 1) ? (size_t) 1 << (arg >> 1) : block_align;
+    ev.pinned = arg & 1;
+    return true;
 }
- 
+
+template class BasicAllocator<GoodFit>;
+template class BasicAllocator<FirstFit>;
+template class BasicAllocator<BestFit>;
+template class BasicAllocator<NextFit>;
+template class BasicAllocator<BuddyFit>;
 
 /*                                      
 char buff[65536];
@@ -1,13 +1,22 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
 #include <stdexcept>
 #include <string>
 #include <vector>
 #include <stdio.h>
 #include <iostream>
 #include <stdint.h>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 
 enum AllocErrorType {
     InvalidFree,
     NoMemory,
+    InvalidAlign,
+    InvalidArena,
 };
 
 class AllocError: std::runtime_error {
@@ -23,7 +32,7 @@ public:
     AllocErrorType getType() const { return type; }
 };
 
-class Allocator;
+template <class Placement> class BasicAllocator;
 
 class Memblock {
 public:
@@ -68,118 +77,841 @@ private:
     size_t size;
 };
 
+// Every block in the arena starts with a header. Free blocks additionally
+// end with a footer holding their size (a boundary tag), so the block that
+// follows can find the start of a free neighbour without any search.
+struct BlockHeader {
+    size_t size;            // whole block size, low bits hold block_flags
+    size_t handle;          // used blocks: owning handle, see set_owner()
+};
+
+struct FreeBlock : BlockHeader {
+    FreeBlock *next_free, *prev_free;
+};
+
+enum BlockFlags {
+    BlockFree = 1,          // the block itself is free
+    PrevFree = 2,           // the block right before it is free
+};
+
+const size_t block_flags = 15;
+const size_t block_align = 16;
+const size_t header_size = sizeof(BlockHeader);
+const size_t min_block = 48;    // header, free-list links and footer
+
+// Handles live in fixed-size segments that are allocated on demand and
+// never moved, so a Pointer may keep the address of its segment while the
+// handle table keeps growing. Within a segment the block metadata is laid
+// out as parallel arrays, so resolving a handle touches only the offsets.
+const int handle_seg_log2 = 12;
+const int handle_seg_size = 1 << handle_seg_log2;
+const int max_handle_segs = 1 << 16;
+
+enum HandleFlags {
+    HandleLive = 1,
+    HandleMoving = 1 << 13,     // the background compactor is copying it
+    HandleMapped = 1 << 14,     // the block is a mapping of its own
+};
+
+// The flag word also holds the block's thread-cache bin (block size in
+// block_align units, 0 if not cacheable), the log2 of an alignment asked
+// for beyond block_align (0 if none) and, above HandleMapped, the pin count.
+const int bin_shift = 1;
+const uint32_t bin_mask = 0x7f << bin_shift;
+const int align_shift = 8;
+const uint32_t align_mask = 0x1f << align_shift;
+const int pin_shift = 15;
+const uint32_t pin_one = 1U << pin_shift;
+
+struct HandleSeg {
+    size_t offset[handle_seg_size];     // payload start relative to base
+    size_t size[handle_seg_size];       // size requested by the caller
+    uint32_t flags[handle_seg_size];
+    uint8_t cache[handle_seg_size];     // thread cache that handed it out, plus one
+};
+
 class Pointer {
 public:
     
-    Pointer() : block(NULL), id(-1) { } 
-    Pointer(Memblock **_block, int _id) : block(_block), id(_id) { } 
+    Pointer() : base(NULL), seg(NULL), id(-1) { } 
+    Pointer(int8_t *_base, HandleSeg *_seg, int _id) :
+        base(_base), seg(_seg), id(_id) { } 
+
+    // The offset is loaded atomically: a background compactor may publish
+    // a new one at any time (see EpochGuard). Blocks mapped on their own lie
+    // outside the arena, so the offset may wrap around.
     void *get() const 
     {
-        if (block != NULL) 
-            return reinterpret_cast<void*> ((*block)->get_start()); 
+        if (seg != NULL) 
+            return reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(base) +
+                    __atomic_load_n(&seg->offset[id & (handle_seg_size - 1)],
+                                    __ATOMIC_SEQ_CST)); 
         else 
             return NULL;
     } 
 
     void set_null()
     {
-        block = NULL;
+        base = NULL;
+        seg = NULL;
         id = -1;
     }
     
     void show()
     {
-        if (block != NULL)
+        if (seg != NULL)
         {
-            (*block)->show();
+            int k = id & (handle_seg_size - 1);
+            Memblock(static_cast<int8_t*>(get()), seg->size[k]).show();
         }
         else
         {
             printf("NULL");
         }
     }
-    int get_id() { return id; }
+    int get_id() const { return id; }
+
+    // A pinned block is never moved by defrag(), so the address from get()
+    // stays valid until the matching unpin(). Pins nest. A block that the
+    // background compactor is moving is pinned once it has arrived.
+    void pin()
+    {
+        if (seg != NULL)
+        {
+            uint32_t *f = &seg->flags[id & (handle_seg_size - 1)];
+            if (__atomic_fetch_add(f, pin_one, __ATOMIC_SEQ_CST) & HandleMoving)
+            {
+                while (__atomic_load_n(f, __ATOMIC_ACQUIRE) & HandleMoving)
+                    std::this_thread::yield();
+            }
+        }
+    }
+
+    void unpin()
+    {
+        if (seg != NULL)
+            __atomic_fetch_sub(&seg->flags[id & (handle_seg_size - 1)], pin_one,
+                               __ATOMIC_RELEASE);
+    }
+
+    bool is_pinned() const
+    {
+        return seg != NULL &&
+               __atomic_load_n(&seg->flags[id & (handle_seg_size - 1)],
+                               __ATOMIC_ACQUIRE) >= pin_one;
+    }
 
 
 private: 
-    Memblock **block;
+    int8_t *base;
+    HandleSeg *seg;
     int id;
 };
 
+// Keeps a block pinned for the lifetime of the guard.
+class PinGuard {
+public:
+    explicit PinGuard(const Pointer &_p) : p(_p) { p.pin(); }
+    ~PinGuard() { p.unpin(); }
+
+    void *get() const { return p.get(); }
+
+private:
+    PinGuard(const PinGuard &);
+    PinGuard &operator=(const PinGuard &);
 
-const int max_ptrs = 2048;
-class Allocator {
+    Pointer p;
+};
+
+
+// The background compactor (see start_compactor) moves blocks while other
+// threads use them. Threads read through Pointers inside an epoch, held by
+// an EpochGuard; the old copy of a moved block is reused only after every
+// thread that was inside an epoch when it moved has left it. Writes have to
+// go through pinned blocks, which the compactor leaves alone.
+const int max_epoch_threads = 256;
+
+// Slot of the calling thread in every EpochDomain, taken on first use and
+// given back when the thread exits.
+int epoch_thread();
+
+class EpochDomain {
 public:
 
-    Allocator(void *_base, size_t _size) :
-        base(reinterpret_cast<int8_t*>(_base)), size(_size)        
-    { 
-        for (int i = 0; i < max_ptrs; i++)
+    EpochDomain() : epoch(1)
+    {
+        for (int t = 0; t < max_epoch_threads; t++)
         {
-            blocks_used[i] = NULL;
-            blocks_free[i] = NULL;
+            active[t].store(0);
+            depth[t] = 0;
         }
-    
-        Memblock *block = new Memblock(base, size);
-        add_block_free(block);
     }
 
-    ~Allocator()
+    // Epochs nest; only the outermost enter() and exit() are recorded.
+    void enter()
+    {
+        int t = epoch_thread();
+        if (depth[t]++ == 0)
+            active[t].store(epoch.load());
+    }
+
+    void exit()
+    {
+        int t = epoch_thread();
+        if (--depth[t] == 0)
+            active[t].store(0, std::memory_order_release);
+    }
+
+    // Starts a new epoch and returns the one that ended.
+    uint64_t advance() { return epoch.fetch_add(1); }
+
+    // The oldest epoch some thread is still inside, ~0 if none.
+    uint64_t oldest()
     {
-        for (int i = 0; i < max_ptrs; i++)
+        uint64_t low = ~(uint64_t) 0;
+        for (int t = 0; t < max_epoch_threads; t++)
         {
-            if (blocks_used[i] != NULL)
-            {
-                delete blocks_used[i];
-                blocks_used[i] = NULL;
-            }
-            if (blocks_free[i] != NULL)
+            uint64_t e = active[t].load();
+            if (e != 0 && e < low)
+                low = e;
+        }
+        return low;
+    }
+
+private:
+    std::atomic<uint64_t> epoch;
+    std::atomic<uint64_t> active[max_epoch_threads];   // 0: not inside
+    uint32_t depth[max_epoch_threads];                  // owner thread only
+};
+
+// Holds an epoch for the lifetime of the guard.
+class EpochGuard {
+public:
+    explicit EpochGuard(EpochDomain &_d) : d(_d) { d.enter(); }
+    ~EpochGuard() { d.exit(); }
+
+private:
+    EpochGuard(const EpochGuard &);
+    EpochGuard &operator=(const EpochGuard &);
+
+    EpochDomain &d;
+};
+
+// In concurrent mode every thread owns a cache of recently freed small
+// blocks, binned by exact block size. Cache hits take only the cache's own
+// (normally uncontended) lock; the arena lock is taken to refill or drain
+// cache_batch blocks at a time. Cached blocks keep their handle and stay
+// used in the arena, with the handle's flags cleared. A block freed by a
+// thread other than the one whose cache handed it out goes back to that
+// cache without locks, through a per-class remote list.
+const int max_thread_caches = 64;
+const size_t cache_max_block = 1024;
+const int cache_classes = cache_max_block / block_align + 1;
+const int cache_depth = 64;
+const int cache_batch = 32;
+
+// Head of a remote list: a handle id in the low 32 bits (remote_end if
+// empty) and a count of updates above it, so that a head that went from A
+// to something else and back to A fails a stale compare-and-swap.
+const uint32_t remote_end = 0xffffffff;
+
+struct ThreadCache {
+    std::mutex lock;
+    int count[cache_classes];
+    int bins[cache_classes][cache_depth];
+    uint64_t allocs, frees;         // operations served by this cache
+    uint64_t remote_frees;          // frees of its blocks by other threads
+
+    // Lock-free stacks of ids freed by other threads, linked through the
+    // handles' size slots; pushed by anyone, emptied in one go by a thread
+    // using this cache.
+    std::atomic<uint64_t> remote[cache_classes];
+    std::atomic<int> remote_count;
+
+    ThreadCache() : allocs(0), frees(0), remote_frees(0), remote_count(0)
+    {
+        for (int c = 0; c < cache_classes; c++)
+        {
+            count[c] = 0;
+            remote[c].store(remote_end);
+        }
+    }
+};
+
+// Kind of pages behind an arena, see ArenaConfig::huge_pages.
+enum ArenaPages {
+    PagesDefault,           // the caller's memory, or normal pages
+    PagesTransparent,       // transparent huge pages asked for with madvise
+    PagesHuge,              // explicit huge pages from MAP_HUGETLB
+};
+
+// Snapshot of the allocator's counters, see Allocator::get_stats().
+struct AllocStats {
+    size_t arena_bytes;             // bytes covered by blocks, headers included
+    size_t used_bytes;
+    size_t free_bytes;
+    size_t largest_free;
+    size_t free_blocks;
+    double fragmentation;
+    size_t live_handles;
+    size_t cached_blocks;           // blocks parked in thread caches
+    size_t reserved_bytes;          // address space of a mapped arena, else 0
+    size_t chunk_bytes;             // its commit unit, the huge page size or more
+    ArenaPages pages;
+    size_t mapped_blocks, mapped_bytes;     // blocks with a mapping of their own
+
+    uint64_t allocs, frees, reallocs, realloc_moves;
+    uint64_t defrags, defrag_steps, defrag_moved_bytes;
+    uint64_t arena_grows, released_bytes;   // chunks committed, bytes madvised
+    uint64_t mremaps;
+    uint64_t remote_frees;          // frees handed to another thread's cache
+};
+
+// Latency histograms have one bucket per power of two nanoseconds.
+enum AllocOp {
+    OpAlloc,
+    OpFree,
+    OpRealloc,
+    op_kinds
+};
+
+const int latency_buckets = 40;
+
+// Allocation traces (see Allocator::start_trace) are a magic word followed
+// by one record per call: an op byte, then the handle id and a size as
+// LEB128 varints. Alloc records end with one more varint, the log2 of the
+// alignment asked for beyond block_align (0 if none) shifted up by one,
+// with the low bit set if the block was allocated pinned.
+enum TraceOp {
+    TraceAlloc = 1,                 // id: handle returned, size: requested
+    TraceFree,                      // id: handle released
+    TraceRealloc,                   // id: handle, size: new size
+    TraceDefrag,
+    TraceDefragStep,                // size: byte budget
+};
+
+const uint32_t trace_magic = 0x32525441;  // "ATR2"
+
+struct TraceEvent {
+    int op;
+    int id;
+    uint64_t size;
+    size_t align;           // allocs only, block_align otherwise
+    bool pinned;            // allocs made with alloc_pinned()
+};
+
+// Reads the next record of a trace file opened for reading; the first call
+// also checks the magic word. Returns false at the end of the trace.
+bool read_trace_event(FILE *f, TraceEvent &ev);
+
+// An arena the allocator maps itself, see BasicAllocator(const ArenaConfig &).
+struct ArenaConfig {
+    size_t reserve;         // address space reserved up front: the size limit
+    size_t chunk;           // commit and release unit, rounded to a power of two
+    const char *path;       // file the arena lives in, NULL for anonymous memory
+
+    // Back an anonymous arena with huge pages: explicit ones if the system
+    // has enough reserved for the whole arena, otherwise transparent ones.
+    // chunk is raised to the huge page size.
+    bool huge_pages;
+
+    // Anonymous arenas only: blocks of at least this many bytes get a
+    // mapping of their own outside the arena, which realloc() resizes with
+    // mremap() instead of copying. 0 keeps every block in the arena.
+    size_t map_threshold;
+
+    explicit ArenaConfig(size_t _reserve, size_t _chunk = 1 << 20,
+                         const char *_path = NULL, bool _huge_pages = false,
+                         size_t _map_threshold = 0) :
+        reserve(_reserve), chunk(_chunk), path(_path), huge_pages(_huge_pages),
+        map_threshold(_map_threshold) { }
+};
+
+// An arena mapped by BasicAllocator(const ArenaConfig &), first chunk usable.
+struct MappedArena {
+    void *at;
+    size_t reserve, chunk;
+    ArenaPages pages;
+    size_t map_threshold;
+};
+
+// A file-backed arena starts with this header; the blocks follow it. All
+// arena metadata is offsets and sizes, so the file can be mapped anywhere.
+struct ArenaFile {
+    uint64_t magic;
+    uint64_t size;          // bytes of the file in use by the arena
+    int64_t root;           // handle id set with set_root(), -1 if none
+};
+
+const uint64_t arena_file_magic = 0x3141524e45524131ULL;  // "1ARENA1" + version
+
+// Free blocks are indexed two-level segregated-fit (TLSF) style: the first
+// level splits sizes by powers of two, the second splits each power of two
+// into sl_count linear classes. A bitmap per level marks non-empty lists,
+// so a fitting class is found with two bit scans instead of a slot walk.
+const int sl_log2 = 4;
+const int sl_count = 1 << sl_log2;
+const int fl_count = 64 - sl_log2 + 1;
+
+// Placement policies pick the free block an allocation of b_size bytes
+// (header included) goes to. A policy is a template argument of
+// BasicAllocator, so the choice costs no indirect call. round() may enlarge
+// the block size, find() returns a free block of at least b_size bytes or
+// NULL, forget() is told when a block boundary disappears in a merge and
+// reset() when defrag() rebuilds the whole arena.
+
+// Good fit: the TLSF lookup, O(1) and close to best fit. The default.
+struct GoodFit {
+    static const char *name() { return "good-fit"; }
+    static size_t round(size_t b_size) { return b_size; }
+
+    template <class A>
+    FreeBlock *find(A &a, size_t b_size) { return a.good_fit(b_size); }
+
+    void forget(BlockHeader *, BlockHeader *) { }
+    void reset() { }
+};
+
+// First fit: the lowest-addressed free block that is big enough. Walks the
+// arena from the start, so allocation cost grows with the number of blocks
+// in front of the first hole; in exchange the top of the arena stays free.
+struct FirstFit {
+    static const char *name() { return "first-fit"; }
+    static size_t round(size_t b_size) { return b_size; }
+
+    template <class A>
+    FreeBlock *find(A &a, size_t b_size)
+    {
+        return a.scan_fit(a.first, a.last, b_size);
+    }
+
+    void forget(BlockHeader *, BlockHeader *) { }
+    void reset() { }
+};
+
+// Best fit: the smallest free block that is big enough. Only the first
+// non-empty size class that holds a fitting block is searched, since every
+// block in a larger class is larger.
+struct BestFit {
+    static const char *name() { return "best-fit"; }
+    static size_t round(size_t b_size) { return b_size; }
+
+    template <class A>
+    FreeBlock *find(A &a, size_t b_size)
+    {
+        int fl, sl;
+        A::mapping(b_size, fl, sl);
+        while (fl < fl_count)
+        {
+            uint32_t sl_map = a.sl_bitmap[fl] & (~0U << sl);
+            for (; sl_map != 0; sl_map &= sl_map - 1)
             {
-                blocks_free[i] = NULL;
-                delete blocks_free[i];
+                FreeBlock *best = NULL;
+                for (FreeBlock *block = a.free_lists[fl][__builtin_ctz(sl_map)];
+                     block; block = block->next_free)
+                {
+                    size_t b = A::block_size(block);
+                    if (b >= b_size && (best == NULL || b < A::block_size(best)))
+                        best = block;
+                }
+                if (best != NULL)
+                    return best;
             }
+            fl++;
+            sl = 0;
         }
+        return NULL;
+    }
+
+    void forget(BlockHeader *, BlockHeader *) { }
+    void reset() { }
+};
+
+// Next fit: first fit that resumes where the previous search stopped and
+// wraps around at the end of the arena.
+class NextFit {
+public:
+    NextFit() : rover(NULL) { }
+
+    static const char *name() { return "next-fit"; }
+    static size_t round(size_t b_size) { return b_size; }
+
+    template <class A>
+    FreeBlock *find(A &a, size_t b_size)
+    {
+        BlockHeader *start = rover ? rover : a.first;
+        FreeBlock *fit = a.scan_fit(start, a.last, b_size);
+        if (fit == NULL)
+            fit = a.scan_fit(a.first, start, b_size);
+        if (fit != NULL)
+            rover = fit;
+        return fit;
+    }
+
+    void forget(BlockHeader *gone, BlockHeader *into)
+    {
+        if (rover == gone)
+            rover = into;
+    }
+    void reset() { rover = NULL; }
+
+private:
+    BlockHeader *rover;     // block the last search stopped at
+};
+
+// Buddy-style sizing: block sizes are rounded up to a power of two, which
+// bounds the number of distinct sizes and keeps freed blocks reusable for
+// any request of the same order. Blocks still coalesce through boundary
+// tags rather than only with their binary buddy, since headers and handles
+// already give O(1) merging with either neighbour.
+struct BuddyFit {
+    static const char *name() { return "buddy"; }
+    static size_t round(size_t b_size)
+    {
+        if (b_size > (size_t) 1 << 62)
+            return b_size;
+        return (size_t) 1 << (64 - __builtin_clzll(b_size - 1));
+    }
+
+    template <class A>
+    FreeBlock *find(A &a, size_t b_size) { return a.good_fit(b_size); }
+
+    void forget(BlockHeader *, BlockHeader *) { }
+    void reset() { }
+};
+
+template <class Placement>
+class BasicAllocator {
+public:
+
+    // With concurrent set, all calls may be made from any thread and small
+    // blocks go through per-thread caches. defrag() and defrag_step() move
+    // blocks, so while they run no other thread may touch the allocator or
+    // dereference its pointers.
+    BasicAllocator(void *_base, size_t _size, bool concurrent = false) :
+        base(reinterpret_cast<int8_t*>(_base)), size(_size),
+        reserved(0), chunk(0), pages(PagesDefault), map_threshold(0), fd(-1), file(NULL),
+        handle_segs(new HandleSeg*[max_handle_segs]), handle_count(0),
+        free_bytes(0), free_blocks(0), compact_cursor(NULL),
+        defrag_threshold(0), merges(0), round_moved(0), idle_merges(~(uint64_t) 0),
+        caches(concurrent ? new ThreadCache[max_thread_caches] : NULL),
+        compactor_stop(false), track_latency(false), trace(NULL)
+    { 
+        ops = AllocStats();
+        for (int op = 0; op < op_kinds; op++)
+        {
+            for (int k = 0; k < latency_buckets; k++)
+                latency[op][k].store(0);
+        }
+
+        reset_free_lists();
+        init_arena();
+    }
+
+    // Maps its own arena: reserves config.reserve bytes of address space and
+    // commits it config.chunk bytes at a time when no free block fits. The
+    // whole chunks inside free blocks are handed back to the OS.
+    //
+    // With config.path the arena is kept in that file. An existing arena
+    // file is reopened with all its blocks and handle ids in place; pins
+    // are not kept, and a restored handle's size is its block's capacity.
+    // The file must not be shared by two allocators at once.
+    explicit BasicAllocator(const ArenaConfig &config, bool concurrent = false);
+
+    ~BasicAllocator()
+    {
+        stop_compactor();
+        unmap_arena();
+        for (int k = 0; k * handle_seg_size < handle_count; k++)
+            delete handle_segs[k];
+        delete[] handle_segs;
+        delete[] caches;
+        stop_trace();
     }
     
-    Pointer alloc(size_t N);
+    // alignment is a power of two; the payload is placed at a multiple of
+    // it and stays so through realloc() and defrag().
+    Pointer alloc(size_t N, size_t alignment = block_align);
     void realloc(Pointer &p, size_t N);
     void free(Pointer &p);
 
+    // Allocates one block per entry of sizes into out, carved from a single
+    // free run when one fits. All or nothing: throws with out left empty.
+    void alloc_batch(const std::vector<size_t> &sizes, std::vector<Pointer> &out);
+
+    // Frees every pointer; blocks that are neighbours go back as one run.
+    void free_batch(std::vector<Pointer> &pointers);
+
+    // Raw-memory interface for code that cannot hold a Pointer: the block
+    // stays pinned until free_pinned(), so its address never changes.
+    void *alloc_pinned(size_t N, size_t alignment = block_align);
+    void free_pinned(void *raw);
+
+    // Handle of the block whose payload starts at raw, as returned by get().
+    Pointer handle_of(void *raw);
+
+    // Handle ids stay valid across reopening a file-backed arena, so data in
+    // the arena can refer to other blocks by id. restore() turns such an id
+    // back into a Pointer (null if it is not live); the root is an id kept
+    // in the file header to find the rest from.
+    Pointer restore(int id);
+    void set_root(const Pointer &p);
+    Pointer root();
+
     void defrag(); 
-    std::string dump() { return ""; }
+
+    // Incremental compaction: slides blocks down until about max_bytes were
+    // copied or max_ns nanoseconds passed (0 means no time limit), resuming
+    // where the previous call stopped. A new round only starts while
+    // fragmentation() is above the threshold. Returns true when the arena
+    // needs no further steps.
+    bool defrag_step(size_t max_bytes, uint64_t max_ns = 0);
+
+    // External fragmentation: 1 - largest free block / all free bytes.
+    double fragmentation();
+    bool needs_defrag();
+    void set_defrag_threshold(double ratio) { defrag_threshold = ratio; }
+
+    AllocStats get_stats();
+
+    // Times every alloc/free/realloc into the latency histograms. Off by
+    // default: reading the clock costs about as much as a cached alloc.
+    void set_latency_tracking(bool on) { track_latency = on; }
+
+    // Runs compaction steps of step_bytes on a thread of its own while the
+    // arena is fragmented beyond the defrag threshold, checking every
+    // period_us microseconds otherwise. Each step holds the arena lock for
+    // at most step_bytes of copying and header reads; after a pass over the
+    // arena that moved nothing it waits for a free. Needs concurrent mode. Threads that
+    // dereference Pointers meanwhile must hold an EpochGuard on epochs(),
+    // and write only to pinned blocks. defrag() and defrag_step() must not
+    // be called while it runs.
+    void start_compactor(uint64_t period_us = 1000, size_t step_bytes = 64 << 10);
+    void stop_compactor();
+    EpochDomain &epochs() { return epoch_domain; }
+
+    // Counters and latency histograms as one JSON object.
+    std::string dump();
+
+    // Records every alloc/free/realloc/defrag call to a binary trace that
+    // allocator_replay can run again. Returns false if path can't be opened.
+    bool start_trace(const char *path);
+    void stop_trace();
 
     void show() 
     {
         printf("Free:\n");
-        for (int i = 0; i < max_ptrs; i++)
+        for (BlockHeader *b = first; b != last; b = next_block(b))
         {
-            if (blocks_free[i] != NULL)
-                blocks_free[i]->show();
+            if (b->size & BlockFree)
+                Memblock(reinterpret_cast<int8_t*>(b), block_size(b)).show();
         }
         printf("\nUsed:\n");
-        for (int i = 0; i < max_ptrs; i++)
+        for (int i = 0; i < handle_count; i++)
         {
-            if (blocks_used[i] != NULL)
-                blocks_used[i]->show();
+            if (h_flags(i) & HandleLive)
+                Memblock(payload(i), h_size(i)).show();
         }
         printf("\n");
     }
 
 private:
 
+    friend Placement;
+
     int8_t *base;
-    size_t size;
+    size_t size;                    // bytes the arena may use now
+
+    // Mapped arenas only: the reservation and the commit/release unit.
+    size_t reserved, chunk;
+    ArenaPages pages;
+    size_t map_threshold;           // 0: no blocks of their own, see ArenaConfig
+
+    BasicAllocator(const MappedArena &m, bool concurrent);
+
+    // File-backed arenas only: the file and its header at base.
+    int fd;
+    ArenaFile *file;
+
+    static MappedArena map_arena(const ArenaConfig &config);
+    void unmap_arena();
+    void open_file(const char *path);
+    void restore_arena();
+    FreeBlock *grow(size_t b_size);
+    void release_chunks(int8_t *lo, int8_t *hi);
+
+    bool use_mapping(size_t N, size_t align)
+    {
+        return map_threshold != 0 && N >= map_threshold && align <= block_align;
+    }
+    int8_t *map_block(size_t N);
+    void realloc_mapped(int id, size_t N);
+    void release_mapped(int id);
+
+    // Blocks tile [first, last); last is a zero-sized used sentinel header.
+    BlockHeader *first, *last;
     
-    Memblock *blocks_used[max_ptrs];
-    Memblock *blocks_free[max_ptrs];
+    HandleSeg **handle_segs;        // max_handle_segs slots, filled on demand
+    std::vector<int> free_handles;  // stack of released handle ids
+    int handle_count;               // ids ever handed out
+
+    HandleSeg *seg_of(int id) { return handle_segs[id >> handle_seg_log2]; }
+    size_t &h_offset(int id) { return seg_of(id)->offset[id & (handle_seg_size - 1)]; }
+    size_t &h_size(int id) { return seg_of(id)->size[id & (handle_seg_size - 1)]; }
+    uint32_t &h_flags(int id) { return seg_of(id)->flags[id & (handle_seg_size - 1)]; }
+    uint8_t &h_cache(int id) { return seg_of(id)->cache[id & (handle_seg_size - 1)]; }
+    int8_t *payload(int id)
+    {
+        return reinterpret_cast<int8_t*>(reinterpret_cast<uintptr_t>(base) + h_offset(id));
+    }
+    size_t offset_of(const int8_t *at)
+    {
+        return reinterpret_cast<uintptr_t>(at) - reinterpret_cast<uintptr_t>(base);
+    }
+    bool pinned(int id) { return h_flags(id) >= pin_one; }
+    // A used block's header keeps its owner's id and, above bit 32, the
+    // owner's alignment, so that the handle table can be rebuilt from it.
+    static int owner(const BlockHeader *b) { return (int) (uint32_t) b->handle; }
+    void set_owner(BlockHeader *b, int id)
+    {
+        b->handle = (uint32_t) id | (size_t) ((h_flags(id) & align_mask) >> align_shift) << 32;
+    }
+
+    size_t align_of(int id)
+    {
+        uint32_t k = (h_flags(id) & align_mask) >> align_shift;
+        return k ? (size_t) 1 << k : block_align;
+    }
+
+    uint64_t fl_bitmap;
+    uint32_t sl_bitmap[fl_count];
+    FreeBlock *free_lists[fl_count][sl_count];
+    size_t free_bytes;
+    size_t free_blocks;
+
+    // Next block defrag_step() looks at, NULL while no round is running.
+    BlockHeader *compact_cursor;
+    double defrag_threshold;
+
+    // evacuate_step() starts no new round after one that moved nothing
+    // until a block is freed back to the arena.
+    uint64_t merges;                // add_block_free() calls
+    size_t round_moved;             // bytes moved in the running round
+    uint64_t idle_merges;           // merges when a round last moved nothing
 
-    int add_block_used(Memblock *block);
-    void del_block_used(int id);
-    int add_block_free(Memblock *block);
-    void del_block_free(int id);
+    Placement placement;
 
-    int find_free_block(int8_t *b_start);
-    void shift_block_used(int id, int8_t *new_start);
-    void shift_block_free(int id, int8_t *new_start);
+    std::mutex arena_lock;
+    ThreadCache *caches;            // NULL unless concurrent
+
+    // Holds arena_lock for a scope in concurrent mode, does nothing otherwise.
+    class ArenaLock {
+    public:
+        explicit ArenaLock(BasicAllocator *a) : m(a->caches ? &a->arena_lock : NULL)
+        {
+            if (m != NULL)
+                m->lock();
+        }
+        ~ArenaLock()
+        {
+            if (m != NULL)
+                m->unlock();
+        }
+    private:
+        std::mutex *m;
+    };
+
+    // Background compaction: old copies wait in retired for their epoch to
+    // be left by every reader.
+    struct Retired {
+        BlockHeader *block;
+        uint64_t epoch;
+    };
+
+    EpochDomain epoch_domain;
+    std::vector<Retired> retired;
+    std::thread compactor;
+    std::mutex compactor_lock;
+    std::condition_variable compactor_wake;
+    bool compactor_stop;
+
+    bool evacuate_step(size_t max_bytes);
+    void reclaim_retired(bool all);
+    void compactor_loop(uint64_t period_us, size_t step_bytes);
+    uint32_t settled_flags(int id);
+
+    AllocStats ops;                 // operation counters, under arena_lock
+    bool track_latency;
+    std::atomic<uint64_t> latency[op_kinds][latency_buckets];
+
+    void note_latency(AllocOp op, uint64_t start);
+
+    std::atomic<FILE*> trace;
+    std::mutex trace_lock;
+
+    void trace_event(int op, int id, uint64_t size, uint64_t arg = 0);
+
+    Pointer alloc_traced(size_t N, size_t alignment, bool pinned);
+    Pointer alloc_any(size_t N, size_t align);
+    void free_any(Pointer &p);
+    void realloc_any(Pointer &p, size_t N);
+    Pointer alloc_block(size_t N, size_t align);
+    void release_block(int id);
+
+    int my_cache();
+    void remote_push(ThreadCache &owner, int c, int id);
+    int remote_take(ThreadCache &cache, int c);
+    bool cache_alloc(size_t N, Pointer &p);
+    bool cache_free(int id);
+    void set_bin(int id, size_t b_size);
+    int carve_batch(size_t b_size, int *out, int n);
+    void flush_caches();
+
+    void init_arena();
+    void arena_bounds();
+    void reset_free_lists();
+    void close_gap(int8_t *dst, BlockHeader *block, BlockHeader *placed);
+
+    int add_handle(int8_t *start, size_t N);
+    void del_handle(int id);
+    void add_block_free(BlockHeader *block, size_t b_size);
+    void split_block(BlockHeader *block, size_t total, size_t b_size);
+    BlockHeader *take_block(FreeBlock *block, size_t b_size);
+    BlockHeader *take_aligned(FreeBlock *block, size_t b_size, size_t align);
+    BlockHeader *take_fit(size_t b_size, size_t align);
+
+    static size_t block_size(const BlockHeader *b) { return b->size & ~block_flags; }
+    static BlockHeader *next_block(BlockHeader *b)
+    {
+        return reinterpret_cast<BlockHeader*>(
+                reinterpret_cast<int8_t*>(b) + block_size(b));
+    }
+    static BlockHeader *prev_block(BlockHeader *b);
+    static BlockHeader *header_of(int8_t *payload)
+    {
+        return reinterpret_cast<BlockHeader*>(payload - header_size);
+    }
+    static size_t block_for(size_t N);
+    static size_t fit_size(size_t N) { return Placement::round(block_for(N)); }
+    static void set_free(BlockHeader *b, size_t b_size);
+    static void set_used(BlockHeader *b, size_t b_size);
+
+    static void mapping(size_t N, int &fl, int &sl);
+    void insert_free(FreeBlock *block);
+    void remove_free(FreeBlock *block);
+    FreeBlock *find_fit(size_t b_size)
+    {
+        FreeBlock *fit = placement.find(*this, b_size);
+        return (fit == NULL && reserved != 0) ? grow(b_size) : fit;
+    }
+    FreeBlock *good_fit(size_t b_size);
+    FreeBlock *scan_fit(BlockHeader *from, BlockHeader *to, size_t b_size);
+    void block_merged(BlockHeader *gone, BlockHeader *into);
+    size_t largest_free();
+    double frag_ratio();
 };
 
+// The placement policies are instantiated in allocator.cpp.
+typedef BasicAllocator<GoodFit> Allocator;
+
+#endif
@@ -0,0 +1,579 @@
+#include "allocator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Synthetic workloads run against Allocator and against glibc malloc with
+// the same random sequence. Each reports throughput and per-operation
+// latency percentiles; `make bench` runs them all. The threads-N rows show
+// how throughput scales with the thread count. The placement section then
+// repeats one workload for every placement policy.
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*: cheap and identical for every backend.
+struct Rng {
+    uint64_t s;
+    explicit Rng(uint64_t seed) : s(seed) { }
+    uint64_t next()
+    {
+        s ^= s >> 12;
+        s ^= s << 25;
+        s ^= s >> 27;
+        return s * 2685821657736338717ULL;
+    }
+    size_t range(size_t lo, size_t hi) { return lo + next() % (hi - lo + 1); }
+};
+
+const size_t arena_size = 256 << 20;
+
+template <class P = GoodFit>
+struct ArenaBackend {
+    typedef Pointer handle;
+
+    std::vector<char> mem;
+    BasicAllocator<P> a;
+
+    explicit ArenaBackend(bool concurrent = false) :
+        mem(arena_size), a(mem.data(), mem.size(), concurrent) { }
+
+    static const char *name() { return "arena"; }
+    handle alloc(size_t n) { return a.alloc(n); }
+    void free(handle &h) { a.free(h); }
+    void realloc(handle &h, size_t n) { a.realloc(h, n); }
+    void *get(const handle &h) { return h.get(); }
+    static handle null() { return Pointer(); }
+};
+
+struct MallocBackend {
+    typedef void *handle;
+
+    explicit MallocBackend(bool = false) { }
+
+    static const char *name() { return "malloc"; }
+    handle alloc(size_t n) { return ::malloc(n); }
+    void free(handle &h) { ::free(h); h = NULL; }
+    void realloc(handle &h, size_t n) { h = ::realloc(h, n); }
+    void *get(const handle &h) { return h; }
+    static handle null() { return NULL; }
+};
+
+struct Result {
+    uint64_t ops;
+    uint64_t ns;
+    std::vector<uint32_t> lat;
+
+    Result() : ops(0), ns(0) { }
+
+    void note(uint64_t start, uint64_t end)
+    {
+        lat.push_back(end - start);
+        ops++;
+    }
+};
+
+static void report(const char *workload, const char *backend, Result &r)
+{
+    std::sort(r.lat.begin(), r.lat.end());
+    uint32_t p50 = r.lat.empty() ? 0 : r.lat[r.lat.size() / 2];
+    uint32_t p99 = r.lat.empty() ? 0 : r.lat[r.lat.size() * 99 / 100];
+    printf("%-18s %-9s %12.0f %8u %8u\n", workload, backend,
+           r.ns ? r.ops * 1e9 / r.ns : 0.0, p50, p99);
+}
+
+// Random alloc/free over a fixed set of slots; sizes from pick_size.
+template <class B, class SizeFn>
+static void random_churn(const char *workload, uint64_t ops, SizeFn pick_size)
+{
+    B b;
+    Rng rng(42);
+    const size_t slots = 10000;
+    std::vector<typename B::handle> live(slots, B::null());
+    std::vector<bool> used(slots, false);
+
+    Result r;
+    r.lat.reserve(ops);
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        size_t k = rng.next() % slots;
+        if (used[k])
+        {
+            uint64_t t = now_ns();
+            b.free(live[k]);
+            r.note(t, now_ns());
+            used[k] = false;
+        }
+        else
+        {
+            size_t n = pick_size(rng);
+            uint64_t t = now_ns();
+            live[k] = b.alloc(n);
+            r.note(t, now_ns());
+            *static_cast<char*>(b.get(live[k])) = 1;
+            used[k] = true;
+        }
+    }
+    r.ns = now_ns() - begin;
+
+    for (size_t k = 0; k < slots; k++)
+    {
+        if (used[k])
+            b.free(live[k]);
+    }
+    report(workload, B::name(), r);
+}
+
+static size_t uniform_size(Rng &rng)
+{
+    return rng.range(16, 1024);
+}
+
+static size_t skewed_size(Rng &rng)
+{
+    size_t p = rng.next() % 100;
+    if (p < 80)
+        return rng.range(16, 64);
+    if (p < 95)
+        return rng.range(65, 512);
+    return rng.range(513, 8192);
+}
+
+// One thread allocates messages, another frees them, through a ring.
+template <class B>
+static void producer_consumer(uint64_t ops)
+{
+    B b(true);
+    const size_t ring_size = 1024;
+    std::vector<typename B::handle> ring(ring_size, B::null());
+    std::atomic<uint64_t> head(0), tail(0);
+
+    Result prod, cons;
+    prod.lat.reserve(ops);
+    cons.lat.reserve(ops);
+
+    uint64_t begin = now_ns();
+    std::thread consumer([&]() {
+        for (uint64_t i = 0; i < ops; i++)
+        {
+            while (tail.load(std::memory_order_acquire) == i)
+                std::this_thread::yield();
+            typename B::handle h = ring[i % ring_size];
+            uint64_t t = now_ns();
+            b.free(h);
+            cons.note(t, now_ns());
+            head.store(i + 1, std::memory_order_release);
+        }
+    });
+
+    Rng rng(7);
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        while (i - head.load(std::memory_order_acquire) >= ring_size)
+            std::this_thread::yield();
+        size_t n = rng.range(64, 256);
+        uint64_t t = now_ns();
+        ring[i % ring_size] = b.alloc(n);
+        prod.note(t, now_ns());
+        memset(b.get(ring[i % ring_size]), 0, n);
+        tail.store(i + 1, std::memory_order_release);
+    }
+    consumer.join();
+    prod.ns = cons.ns = now_ns() - begin;
+
+    prod.lat.insert(prod.lat.end(), cons.lat.begin(), cons.lat.end());
+    prod.ops += cons.ops;
+    report("producer-consumer", B::name(), prod);
+}
+
+// Every thread churns small blocks over slots of its own, ops_per_thread
+// each, so perfect scaling keeps ops/s proportional to the thread count.
+template <class B>
+static void thread_churn(uint64_t ops_per_thread, int threads)
+{
+    B b(true);
+    const size_t slots = 1000;
+    std::vector<Result> results(threads);
+    std::vector<std::thread> workers;
+
+    uint64_t begin = now_ns();
+    for (int w = 0; w < threads; w++)
+    {
+        workers.push_back(std::thread([&b, &results, ops_per_thread, w]() {
+            Rng rng(100 + w);
+            std::vector<typename B::handle> live(slots, B::null());
+            std::vector<bool> used(slots, false);
+            Result &r = results[w];
+            r.lat.reserve(ops_per_thread);
+            for (uint64_t i = 0; i < ops_per_thread; i++)
+            {
+                size_t k = rng.next() % slots;
+                uint64_t t = now_ns();
+                if (used[k])
+                {
+                    b.free(live[k]);
+                    r.note(t, now_ns());
+                }
+                else
+                {
+                    live[k] = b.alloc(rng.range(16, 512));
+                    r.note(t, now_ns());
+                    *static_cast<char*>(b.get(live[k])) = 1;
+                }
+                used[k] = !used[k];
+            }
+            for (size_t k = 0; k < slots; k++)
+            {
+                if (used[k])
+                    b.free(live[k]);
+            }
+        }));
+    }
+    for (std::thread &t: workers)
+        t.join();
+
+    Result all;
+    all.ns = now_ns() - begin;
+    for (int w = 0; w < threads; w++)
+    {
+        all.ops += results[w].ops;
+        all.lat.insert(all.lat.end(), results[w].lat.begin(), results[w].lat.end());
+    }
+
+    char workload[32];
+    snprintf(workload, sizeof(workload), "threads-%d", threads);
+    report(workload, B::name(), all);
+}
+
+// Many buffers grown round-robin by 1.5x, so neighbours get in the way.
+template <class B>
+static void realloc_growth(uint64_t buffers)
+{
+    B b;
+    std::vector<typename B::handle> bufs(buffers, B::null());
+    std::vector<size_t> sizes(buffers, 64);
+    for (uint64_t k = 0; k < buffers; k++)
+        bufs[k] = b.alloc(64);
+
+    Result r;
+    uint64_t begin = now_ns();
+    for (int round = 0; round < 17; round++)
+    {
+        for (uint64_t k = 0; k < buffers; k++)
+        {
+            sizes[k] += sizes[k] / 2;
+            uint64_t t = now_ns();
+            b.realloc(bufs[k], sizes[k]);
+            r.note(t, now_ns());
+            static_cast<char*>(b.get(bufs[k]))[sizes[k] - 1] = 1;
+        }
+    }
+    r.ns = now_ns() - begin;
+
+    for (uint64_t k = 0; k < buffers; k++)
+        b.free(bufs[k]);
+    report("realloc-growth", B::name(), r);
+}
+
+// Request setup and teardown: groups of 16 buffers allocated and freed
+// together while 64 requests are in flight. Latency is per buffer.
+const int group_size = 16;
+const int groups_live = 64;
+
+template <class B>
+static void request_groups(uint64_t ops)
+{
+    B b;
+    Rng rng(5);
+    std::vector<typename B::handle> live(group_size * groups_live, B::null());
+
+    Result r;
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < ops / group_size; i++)
+    {
+        typename B::handle *group = &live[(i % groups_live) * group_size];
+        uint64_t t = now_ns();
+        if (i >= groups_live)
+        {
+            for (int k = 0; k < group_size; k++)
+                b.free(group[k]);
+        }
+        for (int k = 0; k < group_size; k++)
+            group[k] = b.alloc(rng.range(16, 512));
+        uint64_t end = now_ns();
+        for (int k = 0; k < 2 * group_size; k++)
+            r.note(t, t + (end - t) / (2 * group_size));
+    }
+    r.ns = now_ns() - begin;
+
+    for (uint64_t i = 0; i < groups_live && i < ops / group_size; i++)
+    {
+        for (int k = 0; k < group_size; k++)
+            b.free(live[i * group_size + k]);
+    }
+    report("request-groups", B::name(), r);
+}
+
+static void request_groups_batched(uint64_t ops)
+{
+    ArenaBackend<> b;
+    Rng rng(5);
+    std::vector<std::vector<Pointer> > live(groups_live);
+    std::vector<size_t> sizes(group_size);
+
+    Result r;
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < ops / group_size; i++)
+    {
+        std::vector<Pointer> &group = live[i % groups_live];
+        for (int k = 0; k < group_size; k++)
+            sizes[k] = rng.range(16, 512);
+        uint64_t t = now_ns();
+        b.a.free_batch(group);
+        b.a.alloc_batch(sizes, group);
+        uint64_t end = now_ns();
+        for (int k = 0; k < 2 * group_size; k++)
+            r.note(t, t + (end - t) / (2 * group_size));
+    }
+    r.ns = now_ns() - begin;
+
+    for (int i = 0; i < groups_live; i++)
+        b.a.free_batch(live[i]);
+    report("request-groups", "batch", r);
+}
+
+// Fill the arena, free half of the blocks at random, then compact.
+static void defrag_fragmented()
+{
+    ArenaBackend<> b;
+    Rng rng(3);
+    std::vector<Pointer> ptrs;
+    try
+    {
+        while (true)
+        {
+            ptrs.push_back(b.a.alloc(rng.range(16, 4096)));
+            *static_cast<char*>(ptrs.back().get()) = 1;
+        }
+    }
+    catch (AllocError &) { }
+
+    for (size_t k = 0; k < ptrs.size(); k++)
+    {
+        if (rng.next() & 1)
+            b.a.free(ptrs[k]);
+    }
+
+    AllocStats before = b.a.get_stats();
+    uint64_t t = now_ns();
+    b.a.defrag();
+    uint64_t ns = now_ns() - t;
+    AllocStats after = b.a.get_stats();
+
+    printf("%-18s %-9s %8.2f ms for %zu MB arena, %zu MB moved, "
+           "fragmentation %.3f -> %.3f\n",
+           "defrag", "arena", ns / 1e6, before.arena_bytes >> 20,
+           (size_t) (after.defrag_moved_bytes >> 20),
+           before.fragmentation, after.fragmentation);
+}
+
+static volatile uint64_t sink;
+
+// Compacts 2 MB cold blocks behind small holes, then times one pass over a
+// 1 MB hot set that was in cache before the defrag.
+static void defrag_cold()
+{
+    ArenaBackend<> b;
+    std::vector<Pointer> cold;
+    for (int k = 0; k < 48; k++)
+    {
+        Pointer hole = b.a.alloc(4000);
+        cold.push_back(b.a.alloc(2 << 20));
+        memset(cold.back().get(), k, 2 << 20);
+        b.a.free(hole);
+    }
+
+    std::vector<uint64_t> hot((1 << 20) / sizeof(uint64_t), 1);
+    uint64_t sum = 0;
+    for (int pass = 0; pass < 4; pass++)
+    {
+        for (size_t i = 0; i < hot.size(); i++)
+            sum += hot[i];
+    }
+
+    uint64_t t = now_ns();
+    b.a.defrag();
+    uint64_t defrag_ns = now_ns() - t;
+
+    t = now_ns();
+    for (size_t i = 0; i < hot.size(); i += 8)
+        sum += hot[i];
+    uint64_t hot_ns = now_ns() - t;
+    sink = sum;
+
+    printf("%-18s %-9s %8.2f ms to move %zu MB, hot set re-read %.1f us\n",
+           "defrag-cold", "arena", defrag_ns / 1e6,
+           (size_t) (b.a.get_stats().defrag_moved_bytes >> 20), hot_ns / 1e3);
+}
+
+// Random reads over 256 MB of 4 KB buffers in a mapped arena, which is
+// mostly TLB misses unless the arena sits on huge pages.
+static void random_touch(bool huge, uint64_t reads)
+{
+    BasicAllocator<GoodFit> a(ArenaConfig(512 << 20, 2 << 20, NULL, huge));
+    std::vector<Pointer> bufs;
+    for (int k = 0; k < (256 << 20) / 4096; k++)
+    {
+        bufs.push_back(a.alloc(4096));
+        memset(bufs.back().get(), k, 4096);
+    }
+
+    Rng rng(9);
+    uint64_t sum = 0;
+    uint64_t t = now_ns();
+    for (uint64_t i = 0; i < reads; i++)
+    {
+        uint64_t r = rng.next();
+        sum += static_cast<uint8_t*>(bufs[r % bufs.size()].get())[(r >> 32) & 4095];
+    }
+    uint64_t ns = now_ns() - t;
+    sink = sum;
+
+    ArenaPages pages = a.get_stats().pages;
+    printf("%-18s %-9s %8.2f ns per read, %s pages\n", "random-touch",
+           huge ? "huge" : "arena", (double) ns / reads,
+           pages == PagesHuge ? "huge" : pages == PagesTransparent ? "transparent" : "normal");
+}
+
+// A few buffers resized by +-25% at random between 1 and 32 MB, with
+// every block in the arena or the large ones mapped on their own.
+static void large_realloc(bool mapped, uint64_t ops)
+{
+    BasicAllocator<GoodFit> a(ArenaConfig(1ULL << 30, 2 << 20, NULL, false,
+                                          mapped ? 1 << 20 : 0));
+    std::vector<Pointer> bufs(4);
+    std::vector<size_t> sizes(4, 1 << 20);
+    for (size_t k = 0; k < bufs.size(); k++)
+    {
+        bufs[k] = a.alloc(sizes[k]);
+        memset(bufs[k].get(), k, sizes[k]);
+    }
+
+    Rng rng(13);
+    Result r;
+    r.lat.reserve(ops);
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        size_t k = rng.next() % bufs.size();
+        size_t n = rng.next() % 2 ? sizes[k] + sizes[k] / 4 : sizes[k] - sizes[k] / 4;
+        n = std::min<size_t>(std::max<size_t>(n, 1 << 20), 32 << 20);
+
+        uint64_t t = now_ns();
+        a.realloc(bufs[k], n);
+        r.note(t, now_ns());
+        sizes[k] = n;
+    }
+    r.ns = now_ns() - begin;
+
+    report("large-realloc", mapped ? "mremap" : "arena", r);
+}
+
+// Skewed churn with a single policy; besides speed it reports how far up
+// the arena the live blocks ended up and how many holes lie below them.
+template <class P>
+static void placement_churn(uint64_t ops)
+{
+    ArenaBackend<P> b;
+    Rng rng(11);
+    const size_t slots = 10000;
+    std::vector<Pointer> live(slots);
+    std::vector<size_t> sizes(slots, 0);
+
+    Result r;
+    r.lat.reserve(ops);
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        size_t k = rng.next() % slots;
+        uint64_t t = now_ns();
+        if (sizes[k] != 0)
+        {
+            b.a.free(live[k]);
+            sizes[k] = 0;
+        }
+        else
+        {
+            sizes[k] = skewed_size(rng);
+            live[k] = b.a.alloc(sizes[k]);
+        }
+        r.note(t, now_ns());
+    }
+    r.ns = now_ns() - begin;
+
+    size_t top = 0, used = 0;
+    for (size_t k = 0; k < slots; k++)
+    {
+        if (sizes[k] == 0)
+            continue;
+        size_t end = static_cast<char*>(live[k].get()) + sizes[k] - b.mem.data();
+        top = std::max(top, end);
+        used += sizes[k];
+    }
+
+    report("placement-churn", P::name(), r);
+    printf("%-18s %-9s %zu KB live, top at %zu KB, %zu free blocks\n",
+           "placement-space", P::name(), used >> 10, top >> 10,
+           b.a.get_stats().free_blocks);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t ops = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+
+    printf("%-18s %-9s %12s %8s %8s\n", "workload", "backend", "ops/s",
+           "p50 ns", "p99 ns");
+
+    random_churn<ArenaBackend<> >("uniform-churn", ops, uniform_size);
+    random_churn<MallocBackend>("uniform-churn", ops, uniform_size);
+    random_churn<ArenaBackend<> >("skewed-churn", ops, skewed_size);
+    random_churn<MallocBackend>("skewed-churn", ops, skewed_size);
+    producer_consumer<ArenaBackend<> >(ops / 2);
+    producer_consumer<MallocBackend>(ops / 2);
+    for (int threads = 1; threads <= 16; threads *= 2)
+    {
+        thread_churn<ArenaBackend<> >(ops / 8, threads);
+        thread_churn<MallocBackend>(ops / 8, threads);
+    }
+    realloc_growth<ArenaBackend<> >(ops / 1000);
+    realloc_growth<MallocBackend>(ops / 1000);
+    request_groups<ArenaBackend<> >(ops);
+    request_groups_batched(ops);
+    request_groups<MallocBackend>(ops);
+    defrag_fragmented();
+    defrag_cold();
+    random_touch(false, ops * 2);
+    random_touch(true, ops * 2);
+    large_realloc(false, ops / 1000);
+    large_realloc(true, ops / 1000);
+
+    // First and next fit walk the arena, so they get a shorter run.
+    placement_churn<GoodFit>(ops / 10);
+    placement_churn<BestFit>(ops / 10);
+    placement_churn<FirstFit>(ops / 10);
+    placement_churn<NextFit>(ops / 10);
+    placement_churn<BuddyFit>(ops / 10);
+
+    return 0;
+}
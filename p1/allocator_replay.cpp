@@ -0,0 +1,104 @@
+#include "allocator.h"
+
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Re-executes an allocation trace recorded with Allocator::start_trace()
+// against this build of the allocator and reports how long it took and
+// how fragmented the arena got.
+//
+//     allocator_replay trace.bin [arena_mb]
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s trace.bin [arena_mb]\n", argv[0]);
+        return 2;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    size_t arena_mb = argc > 2 ? strtoull(argv[2], NULL, 10) : 256;
+    std::vector<char> mem(arena_mb << 20);
+    Allocator a(mem.data(), mem.size());
+
+    // Recorded ids map to whatever handles this build hands out.
+    std::vector<Pointer> live;
+    TraceEvent ev;
+    uint64_t events = 0, failed = 0, ns = 0;
+    double peak_frag = 0;
+    size_t peak_used = 0;
+
+    while (read_trace_event(f, ev))
+    {
+        if (ev.id >= (int) live.size())
+            live.resize(ev.id + 1);
+
+        uint64_t start = now_ns();
+        try
+        {
+            switch (ev.op)
+            {
+            case TraceAlloc:
+                live[ev.id] = a.alloc(ev.size, ev.align);
+                if (ev.pinned)
+                    live[ev.id].pin();
+                break;
+            case TraceFree:
+                if (live[ev.id].is_pinned())
+                    live[ev.id].unpin();
+                if (live[ev.id].get() != NULL)
+                    a.free(live[ev.id]);
+                break;
+            case TraceRealloc:
+                a.realloc(live[ev.id], ev.size);
+                break;
+            case TraceDefrag:
+                a.defrag();
+                break;
+            case TraceDefragStep:
+                a.defrag_step(ev.size);
+                break;
+            }
+        }
+        catch (AllocError &)
+        {
+            failed++;
+        }
+        ns += now_ns() - start;
+        events++;
+
+        // Sampling keeps the stats walk out of the timed path's way.
+        if ((events & 1023) == 0 || ev.op == TraceDefrag)
+        {
+            AllocStats st = a.get_stats();
+            if (st.fragmentation > peak_frag)
+                peak_frag = st.fragmentation;
+            if (st.used_bytes > peak_used)
+                peak_used = st.used_bytes;
+        }
+    }
+    fclose(f);
+
+    printf("events %llu, failed %llu, time %.3f ms (%.0f ns/event)\n",
+           (unsigned long long) events, (unsigned long long) failed,
+           ns / 1e6, events ? (double) ns / events : 0.0);
+    printf("peak used %zu bytes, peak fragmentation %.4f\n", peak_used, peak_frag);
+    printf("%s\n", a.dump().c_str());
+    return 0;
+}
@@ -1,7 +1,15 @@
 #include "allocator.h"
+#include "slab_pool.h"
+#include "arena_resource.h"
+#include "arena_containers.h"
 
 #include <vector>
 #include <set>
+#include <map>
+#include <string>
+#include <thread>
+#include <string.h>
+#include <sys/mman.h>
 #include <iostream>
 #include "gtest/gtest.h"
 
@@ -318,3 +326,1241 @@ TEST(Allocator, ReallocGrow) {
     a.free(p);
     a.free(p2);
 }
+
+TEST(Allocator, AllocMixedSizes) {
+    Allocator a(buf, sizeof(buf));
+
+    vector<Pointer> ptrs;
+    vector<size_t> sizes;
+    for (int i = 0; i < 64; i++) {
+        sizes.push_back(1 + (i * 97) % 700);
+        ptrs.push_back(a.alloc(sizes.back()));
+        writeTo(ptrs.back(), sizes.back());
+    }
+
+    for (int i = 0; i < 64; i += 2) {
+        a.free(ptrs[i]);
+    }
+    for (int i = 0; i < 64; i += 2) {
+        ptrs[i] = a.alloc(sizes[i]);
+        writeTo(ptrs[i], sizes[i]);
+    }
+
+    for (int i = 0; i < 64; i++) {
+        EXPECT_TRUE(isValidMemory(ptrs[i], sizes[i]));
+        EXPECT_TRUE(isDataOk(ptrs[i], sizes[i]));
+        a.free(ptrs[i]);
+    }
+
+    // Everything is coalesced back: a big block fits again.
+    Pointer p = a.alloc(sizeof(buf) / 2);
+    a.free(p);
+}
+
+TEST(Allocator, FreeCoalesces) {
+    Allocator a(buf, sizeof(buf));
+
+    vector<Pointer> ptrs;
+    int size = 100;
+
+    ASSERT_TRUE(fillUp(a, size, ptrs));
+
+    // Free odd blocks first, then even ones: every free merges both sides.
+    for (size_t i = 1; i < ptrs.size(); i += 2) {
+        a.free(ptrs[i]);
+    }
+    for (size_t i = 0; i < ptrs.size(); i += 2) {
+        a.free(ptrs[i]);
+    }
+
+    Pointer p = a.alloc(sizeof(buf) - 1024);
+    EXPECT_TRUE(isValidMemory(p, sizeof(buf) - 1024));
+    a.free(p);
+}
+
+TEST(Allocator, ManyHandles) {
+    vector<char> big(4 << 20);
+    Allocator a(big.data(), big.size());
+
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 20000; i++) {
+        ptrs.push_back(a.alloc(8));
+        *reinterpret_cast<int*>(ptrs.back().get()) = i;
+    }
+
+    // Released ids are handed out again.
+    int id = ptrs[123].get_id();
+    a.free(ptrs[123]);
+    ptrs[123] = a.alloc(8);
+    EXPECT_EQ(ptrs[123].get_id(), id);
+    *reinterpret_cast<int*>(ptrs[123].get()) = 123;
+
+    for (int i = 0; i < 20000; i++) {
+        EXPECT_EQ(*reinterpret_cast<int*>(ptrs[i].get()), i);
+        a.free(ptrs[i]);
+    }
+}
+
+TEST(Allocator, PointerCopiesFollowMoves) {
+    Allocator a(buf, sizeof(buf));
+
+    int size = 135;
+    Pointer p = a.alloc(size);
+    Pointer p2 = a.alloc(size);
+    writeTo(p, size);
+
+    Pointer copy = p;
+    void *ptr = p.get();
+    a.realloc(p, size * 4);
+
+    EXPECT_NE(p.get(), ptr);
+    EXPECT_EQ(copy.get(), p.get());
+    EXPECT_TRUE(isDataOk(copy, size));
+
+    a.free(p);
+    a.free(p2);
+}
+
+TEST(Allocator, DefragManyBlocks) {
+    vector<char> big(16 << 20);
+    Allocator a(big.data(), big.size());
+
+    vector<Pointer> ptrs;
+    vector<size_t> sizes;
+    for (int i = 0; i < 100000; i++) {
+        sizes.push_back(16 + i % 64);
+        ptrs.push_back(a.alloc(sizes.back()));
+        *reinterpret_cast<int*>(ptrs.back().get()) = i;
+    }
+    for (int i = 0; i < 100000; i += 2) {
+        a.free(ptrs[i]);
+    }
+
+    a.defrag();
+
+    for (int i = 1; i < 100000; i += 2) {
+        EXPECT_EQ(*reinterpret_cast<int*>(ptrs[i].get()), i);
+    }
+
+    // All free space ends up in one block past the live data.
+    Pointer p = a.alloc(big.size() / 2);
+    for (int i = 1; i < 100000; i += 2) {
+        EXPECT_LT(ptrs[i].get(), p.get());
+        a.free(ptrs[i]);
+    }
+    a.free(p);
+}
+
+TEST(Allocator, DefragIncremental) {
+    Allocator a(buf, sizeof(buf));
+
+    vector<Pointer> ptrs;
+    int size = 135;
+
+    ASSERT_TRUE(fillUp(a, size, ptrs));
+    for (size_t i = 0; i < ptrs.size(); i += 3) {
+        a.free(ptrs[i]);
+    }
+    EXPECT_TRUE(a.needs_defrag());
+
+    int steps = 0;
+    bool freed = false;
+    while (!a.defrag_step(4 * size)) {
+        steps++;
+        // The arena may change between steps.
+        if (!freed) {
+            a.free(ptrs[ptrs.size() - 2]);
+            freed = true;
+        }
+    }
+    EXPECT_GT(steps, 1);
+    EXPECT_FALSE(a.needs_defrag());
+
+    for (size_t i = 0; i < ptrs.size(); i++) {
+        if (ptrs[i].get() != nullptr) {
+            EXPECT_TRUE(isDataOk(ptrs[i], size));
+            a.free(ptrs[i]);
+        }
+    }
+}
+
+TEST(Allocator, DefragThreshold) {
+    Allocator a(buf, sizeof(buf));
+
+    int size = 135;
+    Pointer p1 = a.alloc(size);
+    Pointer p2 = a.alloc(size);
+    a.free(p1);
+
+    // One small hole next to a large free tail is below the threshold.
+    a.set_defrag_threshold(0.5);
+    void *ptr = p2.get();
+    EXPECT_TRUE(a.defrag_step(0));
+    EXPECT_EQ(p2.get(), ptr);
+
+    a.set_defrag_threshold(0);
+    EXPECT_TRUE(a.defrag_step(1 << 20));
+    EXPECT_NE(p2.get(), ptr);
+
+    a.free(p2);
+}
+
+TEST(Allocator, DefragSkipsPinned) {
+    Allocator a(buf, sizeof(buf));
+
+    vector<Pointer> ptrs;
+    int size = 135;
+
+    ASSERT_TRUE(fillUp(a, size, ptrs));
+    for (size_t i = 0; i < ptrs.size(); i += 4) {
+        a.free(ptrs[i]);
+    }
+
+    Pointer pinned = ptrs[10];
+    void *raw = pinned.get();
+    Pointer after = ptrs[13];
+    void *moved = after.get();
+
+    {
+        PinGuard guard(pinned);
+        EXPECT_TRUE(pinned.is_pinned());
+
+        a.defrag();
+        EXPECT_EQ(pinned.get(), raw);
+        EXPECT_NE(after.get(), moved);
+
+        moved = after.get();
+        a.free(ptrs[9]);
+        while (!a.defrag_step(size)) {}
+        EXPECT_EQ(guard.get(), raw);
+    }
+    EXPECT_FALSE(pinned.is_pinned());
+
+    a.defrag();
+    EXPECT_NE(pinned.get(), raw);
+
+    for (Pointer &p: ptrs) {
+        if (p.get() != nullptr) {
+            EXPECT_TRUE(isDataOk(p, size));
+            a.free(p);
+        }
+    }
+}
+
+TEST(Allocator, DefragStepBudgetCoversSkips) {
+    Allocator a(buf, sizeof(buf));
+    a.set_defrag_threshold(0);
+
+    // Nothing can move, so each step ends once skipping blocks has used
+    // up its budget rather than walking the whole arena.
+    vector<Pointer> ptrs;
+    int size = 100;
+    ASSERT_TRUE(fillUp(a, size, ptrs));
+    for (size_t i = 0; i < ptrs.size(); i++) {
+        ptrs[i].pin();
+    }
+    for (size_t i = 0; i < ptrs.size(); i += 2) {
+        ptrs[i].unpin();
+        a.free(ptrs[i]);
+    }
+
+    size_t steps = 0;
+    while (!a.defrag_step(64)) {
+        steps++;
+    }
+    EXPECT_GT(steps, ptrs.size() / 16);
+    EXPECT_EQ(a.get_stats().defrag_moved_bytes, 0u);
+
+    for (Pointer &p: ptrs) {
+        if (p.get() != nullptr) {
+            p.unpin();
+            EXPECT_TRUE(isDataOk(p, size));
+            a.free(p);
+        }
+    }
+}
+
+TEST(Allocator, ConcurrentAllocFree) {
+    vector<char> big(8 << 20);
+    Allocator a(big.data(), big.size(), true);
+
+    const int threads = 8;
+    vector<thread> workers;
+    vector<int> ok(threads, 0);
+
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&a, &ok, t]() {
+            vector<Pointer> ptrs;
+            vector<size_t> sizes;
+            bool good = true;
+            for (int round = 0; round < 20; round++) {
+                for (int i = 0; i < 200; i++) {
+                    sizes.push_back(1 + (i * 37 + t) % 1500);
+                    ptrs.push_back(a.alloc(sizes.back()));
+                    memset(ptrs.back().get(), t, sizes.back());
+                }
+                for (size_t i = 0; i < ptrs.size(); i++) {
+                    char *v = reinterpret_cast<char*>(ptrs[i].get());
+                    for (size_t k = 0; k < sizes[i]; k++) {
+                        good = good && v[k] == t;
+                    }
+                    a.free(ptrs[i]);
+                }
+                ptrs.clear();
+                sizes.clear();
+            }
+            ok[t] = good;
+        }));
+    }
+    for (thread &w: workers) {
+        w.join();
+    }
+    for (int t = 0; t < threads; t++) {
+        EXPECT_TRUE(ok[t]);
+    }
+
+    // Cached blocks go back to the arena when it runs short.
+    Pointer p = a.alloc(big.size() - (1 << 16));
+    a.free(p);
+}
+
+struct Session {
+    int id;
+    double score;
+    char name[20];
+
+    Session(int _id) : id(_id), score(_id * 0.5) {
+        snprintf(name, sizeof(name), "session-%d", _id);
+    }
+};
+
+TEST(SlabPool, CreateDestroy) {
+    Allocator a(buf, sizeof(buf));
+    SlabPool<Session> pool(a);
+
+    vector<Session*> objs;
+    set<Session*> unique;
+    for (int i = 0; i < 300; i++) {
+        objs.push_back(pool.create(i));
+        EXPECT_TRUE(unique.insert(objs.back()).second);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(objs.back()) % alignof(Session), 0u);
+    }
+
+    for (int i = 0; i < 300; i += 2) {
+        pool.destroy(objs[i]);
+    }
+    for (int i = 0; i < 300; i += 2) {
+        objs[i] = pool.create(i);
+    }
+
+    // Slabs are pinned: compaction leaves the objects where they are.
+    Session *first = objs[0];
+    a.defrag();
+    EXPECT_EQ(objs[0], first);
+
+    for (int i = 0; i < 300; i++) {
+        EXPECT_EQ(objs[i]->id, i);
+        EXPECT_EQ(objs[i]->score, i * 0.5);
+        pool.destroy(objs[i]);
+    }
+}
+
+TEST(SlabPool, ReturnsEmptySlabs) {
+    Allocator a(buf, sizeof(buf));
+
+    {
+        SlabPool<Session> pool(a);
+        vector<Session*> objs;
+        for (int i = 0; i < 200; i++) {
+            objs.push_back(pool.create(i));
+        }
+        for (Session *s: objs) {
+            pool.destroy(s);
+        }
+    }
+
+    Pointer p = a.alloc(sizeof(buf) - 1024);
+    a.free(p);
+}
+
+TEST(ArenaResource, PmrContainers) {
+    vector<char> big(1 << 20);
+    Allocator a(big.data(), big.size());
+    ArenaResource res(a);
+
+    {
+        std::pmr::vector<int> v(&res);
+        for (int i = 0; i < 10000; i++) {
+            v.push_back(i);
+        }
+        std::pmr::string s("a string long enough to skip the small buffer", &res);
+        EXPECT_GE(v.data(), reinterpret_cast<int*>(big.data()));
+        EXPECT_LT(v.data(), reinterpret_cast<int*>(big.data() + big.size()));
+
+        int *data = v.data();
+        a.defrag();
+        EXPECT_EQ(v.data(), data);
+
+        for (int i = 0; i < 10000; i++) {
+            EXPECT_EQ(v[i], i);
+        }
+        EXPECT_EQ(s, "a string long enough to skip the small buffer");
+    }
+
+    // Everything went back to the arena.
+    Pointer p = a.alloc(big.size() - 1024);
+    a.free(p);
+}
+
+TEST(ArenaResource, StdAllocator) {
+    vector<char> big(1 << 20);
+    Allocator a(big.data(), big.size());
+
+    {
+        ArenaAllocator<std::pair<const int, int>> alloc(a);
+        std::map<int, int, std::less<int>, ArenaAllocator<std::pair<const int, int>>> m(alloc);
+        for (int i = 0; i < 1000; i++) {
+            m[i] = i * i;
+        }
+
+        ArenaAllocator<int> ints(a);
+        vector<int, ArenaAllocator<int>> v(ints);
+        v.assign(5000, 7);
+
+        a.defrag();
+        for (int i = 0; i < 1000; i++) {
+            EXPECT_EQ(m[i], i * i);
+        }
+        EXPECT_EQ(v[4999], 7);
+    }
+
+    Pointer p = a.alloc(big.size() - 1024);
+    a.free(p);
+}
+
+TEST(Allocator, ReallocGrowBackward) {
+    Allocator a(buf, sizeof(buf));
+
+    int size = 135;
+    Pointer p1 = a.alloc(size);
+    Pointer p2 = a.alloc(size);
+    Pointer p3 = a.alloc(size);
+
+    void *ptr = p1.get();
+    a.free(p1);
+    writeTo(p2, size);
+
+    // p3 blocks growth forward; the hole left by p1 is used instead.
+    a.realloc(p2, size * 2);
+    EXPECT_EQ(p2.get(), ptr);
+    EXPECT_TRUE(isDataOk(p2, size));
+
+    writeTo(p2, size * 2);
+    writeTo(p3, size);
+    EXPECT_TRUE(isDataOk(p2, size * 2));
+    EXPECT_TRUE(isDataOk(p3, size));
+
+    a.free(p2);
+    a.free(p3);
+}
+
+TEST(Allocator, StatsAndDump) {
+    Allocator a(buf, sizeof(buf));
+    a.set_latency_tracking(true);
+
+    int size = 135;
+    Pointer p1 = a.alloc(size);
+    Pointer p2 = a.alloc(size);
+    Pointer p3 = a.alloc(size);
+    a.free(p2);
+    a.realloc(p1, size * 4);
+
+    AllocStats st = a.get_stats();
+    EXPECT_EQ(st.allocs, 3u);
+    EXPECT_EQ(st.frees, 1u);
+    EXPECT_EQ(st.reallocs, 1u);
+    EXPECT_EQ(st.realloc_moves, 1u);
+    EXPECT_EQ(st.live_handles, 2u);
+    EXPECT_EQ(st.free_blocks, 2u);
+    EXPECT_EQ(st.used_bytes + st.free_bytes, st.arena_bytes);
+    EXPECT_LT(st.largest_free, st.free_bytes);
+    EXPECT_GT(st.fragmentation, 0.0);
+
+    string json = a.dump();
+    EXPECT_EQ(json.front(), '{');
+    EXPECT_EQ(json.back(), '}');
+    EXPECT_NE(json.find("\"free_blocks\":2,"), string::npos);
+    EXPECT_NE(json.find("\"alloc\":3,"), string::npos);
+    EXPECT_NE(json.find("\"realloc\":{\"count\":1,"), string::npos);
+
+    a.free(p1);
+    a.free(p3);
+    EXPECT_EQ(a.get_stats().free_blocks, 1u);
+    EXPECT_EQ(a.get_stats().fragmentation, 0.0);
+}
+
+TEST(Allocator, TraceRecord) {
+    const char *path = "allocator_trace_test.bin";
+    Allocator a(buf, sizeof(buf));
+    ASSERT_TRUE(a.start_trace(path));
+
+    Pointer p1 = a.alloc(100);
+    EXPECT_THROW(a.alloc(sizeof(buf)), AllocError);
+    a.realloc(p1, 1000);
+    int id = p1.get_id();
+    a.free(p1);
+    a.defrag();
+    Pointer aligned = a.alloc(100, 256);
+    void *raw = a.alloc_pinned(200);
+    a.stop_trace();
+    a.free(aligned);
+    a.free_pinned(raw);
+
+    FILE *f = fopen(path, "rb");
+    ASSERT_NE(f, nullptr);
+    TraceEvent ev;
+    int ops[4] = { TraceAlloc, TraceRealloc, TraceFree, TraceDefrag };
+    uint64_t sizes[4] = { 100, 1000, 0, 0 };
+    for (int k = 0; k < 4; k++) {
+        ASSERT_TRUE(read_trace_event(f, ev));
+        EXPECT_EQ(ev.op, ops[k]);
+        EXPECT_EQ(ev.size, sizes[k]);
+        if (k < 3) {
+            EXPECT_EQ(ev.id, id);
+        }
+        EXPECT_EQ(ev.align, block_align);
+        EXPECT_FALSE(ev.pinned);
+    }
+
+    // Alignment and pinning are replayed with the alloc.
+    ASSERT_TRUE(read_trace_event(f, ev));
+    EXPECT_EQ(ev.op, TraceAlloc);
+    EXPECT_EQ(ev.size, 100u);
+    EXPECT_EQ(ev.align, 256u);
+    EXPECT_FALSE(ev.pinned);
+    ASSERT_TRUE(read_trace_event(f, ev));
+    EXPECT_EQ(ev.size, 200u);
+    EXPECT_EQ(ev.align, block_align);
+    EXPECT_TRUE(ev.pinned);
+    EXPECT_FALSE(read_trace_event(f, ev));
+    fclose(f);
+    remove(path);
+}
+
+template <class P>
+class Placement : public ::testing::Test { };
+
+typedef ::testing::Types<GoodFit, FirstFit, BestFit, NextFit, BuddyFit> Policies;
+TYPED_TEST_CASE(Placement, Policies);
+
+TYPED_TEST(Placement, ChurnKeepsData) {
+    BasicAllocator<TypeParam> a(buf, sizeof(buf));
+
+    vector<Pointer> ptrs(48);
+    vector<size_t> sizes(48, 0);
+    for (int round = 0; round < 20; round++) {
+        for (int i = round % 3; i < 48; i += 3) {
+            if (sizes[i] != 0) {
+                EXPECT_TRUE(isDataOk(ptrs[i], sizes[i]));
+                a.free(ptrs[i]);
+            }
+            sizes[i] = 1 + (i * 131 + round * 17) % 600;
+            ptrs[i] = a.alloc(sizes[i]);
+            writeTo(ptrs[i], sizes[i]);
+        }
+        a.realloc(ptrs[round], sizes[round] * 2);
+        sizes[round] *= 2;
+        writeTo(ptrs[round], sizes[round]);
+        if (round % 5 == 4) {
+            a.defrag();
+        }
+    }
+
+    for (int i = 0; i < 48; i++) {
+        EXPECT_TRUE(isValidMemory(ptrs[i], sizes[i]));
+        EXPECT_TRUE(isDataOk(ptrs[i], sizes[i]));
+        a.free(ptrs[i]);
+    }
+    EXPECT_EQ(a.get_stats().free_blocks, 1u);
+}
+
+// Holes of 128, 416 and 224 bytes separated by used blocks, then the rest
+// of the arena. A 150 byte request needs a 176 byte block.
+template <class P>
+static void *placeAfterHoles(vector<void*> &holes) {
+    BasicAllocator<P> a(buf, sizeof(buf));
+    size_t sizes[6] = { 100, 50, 400, 50, 200, 50 };
+    Pointer ptrs[6];
+    for (int i = 0; i < 6; i++) {
+        ptrs[i] = a.alloc(sizes[i]);
+    }
+    for (int i = 0; i < 6; i += 2) {
+        holes.push_back(ptrs[i].get());
+        a.free(ptrs[i]);
+    }
+    return a.alloc(150).get();
+}
+
+TEST(Placement, ChoosesBlock) {
+    vector<void*> holes;
+    void *p = placeAfterHoles<FirstFit>(holes);
+    EXPECT_EQ(p, holes[1]);
+    holes.clear();
+    p = placeAfterHoles<BestFit>(holes);
+    EXPECT_EQ(p, holes[2]);
+    holes.clear();
+    p = placeAfterHoles<NextFit>(holes);
+    EXPECT_GT(p, holes[2]);
+}
+
+TEST(Allocator, MappedArenaGrows) {
+    Allocator a(ArenaConfig(8 << 20, 64 << 10));
+    EXPECT_EQ(a.get_stats().reserved_bytes, 8u << 20);
+    EXPECT_EQ(a.get_stats().chunk_bytes, 64u << 10);
+    EXPECT_LT(a.get_stats().arena_bytes, 64u << 10);
+
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 1000; i++) {
+        ptrs.push_back(a.alloc(1000));
+        writeTo(ptrs.back(), 1000);
+    }
+    AllocStats st = a.get_stats();
+    EXPECT_GT(st.arena_bytes, 1000u * 1000);
+    EXPECT_GT(st.arena_grows, 0u);
+
+    EXPECT_THROW(a.alloc(8 << 20), AllocError);
+    Pointer big = a.alloc(4 << 20);
+    writeTo(big, 4 << 20);
+
+    for (Pointer &p: ptrs) {
+        EXPECT_TRUE(isDataOk(p, 1000));
+    }
+    EXPECT_TRUE(isDataOk(big, 4 << 20));
+}
+
+TEST(Allocator, MappedArenaReleasesChunks) {
+    size_t chunk = 64 << 10;
+    Allocator a(ArenaConfig(16 << 20, chunk));
+
+    Pointer p1 = a.alloc(1 << 20);
+    Pointer p2 = a.alloc(1 << 20);
+    writeTo(p1, 1 << 20);
+    writeTo(p2, 1 << 20);
+    char *mid = static_cast<char*>(p1.get()) + (1 << 19);
+    mid = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(mid) & ~(chunk - 1));
+
+    unsigned char resident = 0;
+    ASSERT_EQ(mincore(mid, 4096, &resident), 0);
+    EXPECT_TRUE(resident & 1);
+
+    a.free(p1);
+    EXPECT_GE(a.get_stats().released_bytes, (1u << 20) - 2 * chunk);
+    ASSERT_EQ(mincore(mid, 4096, &resident), 0);
+    EXPECT_FALSE(resident & 1);
+
+    // Released memory is usable again.
+    p1 = a.alloc(1 << 20);
+    writeTo(p1, 1 << 20);
+    EXPECT_TRUE(isDataOk(p1, 1 << 20));
+    EXPECT_TRUE(isDataOk(p2, 1 << 20));
+}
+
+TEST(Allocator, MappedBlocksRemap) {
+    Allocator a(ArenaConfig(4 << 20, 64 << 10, NULL, false, 1 << 20));
+
+    // Past the threshold the block leaves the arena with one copy...
+    Pointer p = a.alloc(600 << 10);
+    writeTo(p, 600 << 10);
+    a.realloc(p, 2 << 20);
+    AllocStats st = a.get_stats();
+    EXPECT_EQ(st.mapped_blocks, 1u);
+    EXPECT_EQ(st.realloc_moves, 1u);
+    EXPECT_TRUE(isDataOk(p, 600 << 10));
+
+    // ...and then grows by remapping, beyond what the arena could hold.
+    writeTo(p, 2 << 20);
+    for (size_t n = 3 << 20; n <= (32u << 20); n *= 2) {
+        a.realloc(p, n);
+    }
+    st = a.get_stats();
+    EXPECT_EQ(st.realloc_moves, 1u);
+    EXPECT_GE(st.mremaps, 4u);
+    EXPECT_GE(st.mapped_bytes, 24u << 20);
+    EXPECT_TRUE(isDataOk(p, 2 << 20));
+    EXPECT_EQ(a.handle_of(p.get()).get_id(), p.get_id());
+
+    // Defrag leaves it alone; shrinking brings it back into the arena.
+    Pointer q = a.alloc(4 << 20);
+    a.defrag();
+    EXPECT_TRUE(isDataOk(p, 2 << 20));
+    a.realloc(p, 1000);
+    EXPECT_TRUE(isDataOk(p, 1000));
+    EXPECT_EQ(a.get_stats().mapped_blocks, 1u);
+
+    vector<Pointer> both = {p, q};
+    a.free_batch(both);
+    st = a.get_stats();
+    EXPECT_EQ(st.mapped_blocks, 0u);
+    EXPECT_EQ(st.mapped_bytes, 0u);
+    EXPECT_EQ(st.live_handles, 0u);
+}
+
+static bool isAligned(Pointer &p, size_t alignment) {
+    return (reinterpret_cast<uintptr_t>(p.get()) & (alignment - 1)) == 0;
+}
+
+TEST(Allocator, BatchMapsLargeBlocks) {
+    Allocator a(ArenaConfig(4 << 20, 64 << 10, NULL, false, 1 << 20));
+
+    // Blocks past the threshold get their own mapping inside a batch too;
+    // the rest share one run.
+    vector<size_t> sizes = { 100, 2 << 20, 200, 1 << 20, 300 };
+    vector<Pointer> ptrs;
+    a.alloc_batch(sizes, ptrs);
+    ASSERT_EQ(ptrs.size(), sizes.size());
+    AllocStats st = a.get_stats();
+    EXPECT_EQ(st.mapped_blocks, 2u);
+    EXPECT_LT(st.arena_bytes - st.free_bytes, 64u << 10);
+    EXPECT_GT(ptrs[2].get(), ptrs[0].get());
+    EXPECT_GT(ptrs[4].get(), ptrs[2].get());
+    for (size_t i = 0; i < sizes.size(); i++) {
+        writeTo(ptrs[i], sizes[i]);
+        EXPECT_TRUE(isDataOk(ptrs[i], sizes[i]));
+        EXPECT_EQ(a.handle_of(ptrs[i].get()).get_id(), ptrs[i].get_id());
+    }
+
+    a.free_batch(ptrs);
+    st = a.get_stats();
+    EXPECT_EQ(st.mapped_blocks, 0u);
+    EXPECT_EQ(st.live_handles, 0u);
+    EXPECT_EQ(st.free_blocks, 1u);
+}
+
+TEST(Allocator, AlignedAlloc) {
+    Allocator a(buf, sizeof(buf));
+    EXPECT_THROW(a.alloc(100, 48), AllocError);
+    EXPECT_THROW(a.alloc(100, 0), AllocError);
+
+    vector<Pointer> ptrs;
+    vector<size_t> aligns;
+    for (int i = 0; i < 40; i++) {
+        aligns.push_back((size_t) 1 << (i % 9));
+        ptrs.push_back(a.alloc(1 + i * 37 % 300, aligns.back()));
+        EXPECT_TRUE(isAligned(ptrs.back(), aligns.back()));
+        writeTo(ptrs.back(), 1 + i * 37 % 300);
+    }
+
+    for (int i = 0; i < 40; i += 3) {
+        a.free(ptrs[i]);
+    }
+    for (int i = 1; i < 40; i += 3) {
+        a.realloc(ptrs[i], 600);
+        EXPECT_TRUE(isAligned(ptrs[i], aligns[i]));
+        EXPECT_TRUE(isDataOk(ptrs[i], 1 + i * 37 % 300));
+    }
+
+    a.defrag();
+    for (int i = 0; i < 40; i++) {
+        if (i % 3 == 0) {
+            continue;
+        }
+        EXPECT_TRUE(isAligned(ptrs[i], aligns[i]));
+        EXPECT_TRUE(isDataOk(ptrs[i], 1 + i * 37 % 300));
+        a.free(ptrs[i]);
+    }
+    EXPECT_EQ(a.get_stats().free_blocks, 1u);
+}
+
+TEST(Allocator, AlignedDefragStep) {
+    Allocator a(buf, sizeof(buf));
+
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 60; i++) {
+        ptrs.push_back(a.alloc(40 + i * 13 % 200, i % 2 ? 64 : 16));
+        writeTo(ptrs.back(), 40 + i * 13 % 200);
+    }
+    for (int i = 0; i < 60; i += 4) {
+        a.free(ptrs[i]);
+    }
+
+    while (!a.defrag_step(256)) { }
+    for (int i = 0; i < 60; i++) {
+        if (i % 4 == 0) {
+            continue;
+        }
+        EXPECT_TRUE(isAligned(ptrs[i], i % 2 ? 64 : 16));
+        EXPECT_TRUE(isDataOk(ptrs[i], 40 + i * 13 % 200));
+    }
+    EXPECT_GT(a.get_stats().defrag_moved_bytes, 0u);
+}
+
+TEST(ArenaResource, OverAligned) {
+    vector<char> big(1 << 20);
+    Allocator a(big.data(), big.size());
+    ArenaResource res(a);
+
+    void *p = res.allocate(1000, 256);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(p) & 255, 0u);
+    res.deallocate(p, 1000, 256);
+
+    struct alignas(64) Line { char c[64]; };
+    ArenaAllocator<Line> alloc(a);
+    std::vector<Line, ArenaAllocator<Line> > lines(alloc);
+    lines.resize(10);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(lines.data()) & 63, 0u);
+}
+
+TEST(Allocator, BatchAllocFree) {
+    Allocator a(buf, sizeof(buf));
+    Pointer before = a.alloc(100);
+
+    vector<size_t> sizes;
+    for (int i = 0; i < 20; i++) {
+        sizes.push_back(1 + i * 53 % 400);
+    }
+    vector<Pointer> ptrs;
+    a.alloc_batch(sizes, ptrs);
+    ASSERT_EQ(ptrs.size(), sizes.size());
+    for (int i = 0; i < 20; i++) {
+        writeTo(ptrs[i], sizes[i]);
+        if (i > 0) {
+            EXPECT_GT(ptrs[i].get(), ptrs[i - 1].get());
+        }
+    }
+    for (int i = 0; i < 20; i++) {
+        EXPECT_TRUE(isValidMemory(ptrs[i], sizes[i]));
+        EXPECT_TRUE(isDataOk(ptrs[i], sizes[i]));
+    }
+    EXPECT_EQ(a.get_stats().free_blocks, 1u);
+
+    // Every other one first, the last merging with the free tail; then
+    // the rest, which fills the holes back to one run.
+    vector<Pointer> odd, even;
+    for (int i = 0; i < 20; i++) {
+        (i % 2 ? odd : even).push_back(ptrs[i]);
+    }
+    a.free_batch(odd);
+    EXPECT_EQ(odd[0].get_id(), -1);
+    EXPECT_EQ(a.get_stats().free_blocks, 10u);
+    a.free_batch(even);
+    EXPECT_EQ(a.get_stats().free_blocks, 1u);
+    a.free(before);
+    AllocStats st = a.get_stats();
+    EXPECT_EQ(st.free_blocks, 1u);
+    EXPECT_EQ(st.allocs, 21u);
+    EXPECT_EQ(st.frees, 21u);
+
+    // All or nothing.
+    sizes.assign(3, sizeof(buf) / 2);
+    EXPECT_THROW(a.alloc_batch(sizes, ptrs), AllocError);
+    EXPECT_TRUE(ptrs.empty());
+    EXPECT_EQ(a.get_stats().free_blocks, 1u);
+}
+
+TEST(Allocator, FileArenaReopens) {
+    const char *path = "allocator_file_test.arena";
+    remove(path);
+
+    vector<int> ids;
+    vector<size_t> sizes, aligns;
+    {
+        Allocator a(ArenaConfig(16 << 20, 64 << 10, path));
+        EXPECT_FALSE(a.root().get());
+
+        vector<Pointer> ptrs;
+        for (int i = 0; i < 300; i++) {
+            ptrs.push_back(a.alloc(1 + i * 71 % 2000, i % 5 ? 16 : 128));
+            writeTo(ptrs.back(), 1 + i * 71 % 2000);
+        }
+        for (int i = 0; i < 300; i += 3) {
+            a.free(ptrs[i]);
+        }
+
+        // The root block lists the ids of the others.
+        Pointer list = a.alloc(300 * sizeof(int));
+        int *v = static_cast<int*>(list.get());
+        for (int i = 1; i < 300; i++) {
+            if (i % 3 != 0) {
+                v[ids.size()] = ptrs[i].get_id();
+                ids.push_back(ptrs[i].get_id());
+                sizes.push_back(1 + i * 71 % 2000);
+                aligns.push_back(i % 5 ? 16 : 128);
+            }
+        }
+        a.set_root(list);
+    }
+
+    Allocator b(ArenaConfig(16 << 20, 64 << 10, path));
+    Pointer list = b.root();
+    ASSERT_TRUE(list.get());
+    int *v = static_cast<int*>(list.get());
+    for (size_t k = 0; k < ids.size(); k++) {
+        EXPECT_EQ(v[k], ids[k]);
+        Pointer p = b.restore(v[k]);
+        ASSERT_TRUE(p.get());
+        EXPECT_TRUE(isDataOk(p, sizes[k]));
+    }
+    EXPECT_FALSE(b.restore(-1).get());
+
+    // Restored handles keep working: compact, then check again.
+    b.defrag();
+    for (size_t k = 0; k < ids.size(); k++) {
+        Pointer p = b.restore(ids[k]);
+        EXPECT_TRUE(isDataOk(p, sizes[k]));
+        EXPECT_TRUE(isAligned(p, aligns[k]));
+    }
+    Pointer more = b.alloc(4 << 20);
+    writeTo(more, 4 << 20);
+    remove(path);
+}
+
+TEST(Allocator, FileArenaRejectsOtherFiles) {
+    const char *path = "allocator_file_test.bad";
+    FILE *f = fopen(path, "wb");
+    fputs("not an arena", f);
+    fclose(f);
+    EXPECT_THROW(Allocator(ArenaConfig(1 << 20, 64 << 10, path)), AllocError);
+    remove(path);
+}
+
+TEST(Allocator, HugePageArena) {
+    Allocator a(ArenaConfig(64 << 20, 64 << 10, NULL, true));
+    AllocStats st = a.get_stats();
+    ASSERT_NE(st.pages, PagesDefault);
+
+    // Chunks are rounded up to the huge page size of this host.
+    size_t huge = st.chunk_bytes;
+    EXPECT_GE(huge, 64u << 10);
+    EXPECT_EQ(huge & (huge - 1), 0u);
+    EXPECT_EQ(st.reserved_bytes % huge, 0u);
+    EXPECT_NE(a.dump().find(st.pages == PagesHuge ? "\"pages\":\"huge\"" :
+                                                    "\"pages\":\"transparent\""),
+              string::npos);
+
+    // The arena starts on a huge page boundary and grows a huge page at a time.
+    Pointer p = a.alloc(8 << 20);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(p.get()) & (huge - 1), header_size);
+    writeTo(p, 8 << 20);
+    EXPECT_TRUE(isDataOk(p, 8 << 20));
+    EXPECT_EQ(a.get_stats().arena_bytes % huge, huge - header_size);
+
+    Allocator plain(ArenaConfig(1 << 20));
+    EXPECT_EQ(plain.get_stats().pages, PagesDefault);
+}
+
+TEST(Allocator, BackgroundCompaction) {
+    vector<char> big(4 << 20);
+    Allocator a(big.data(), big.size(), true);
+    EXPECT_THROW(Allocator(buf, sizeof(buf)).start_compactor(), AllocError);
+
+    // Too big for the thread caches, so frees leave holes in the arena.
+    vector<Pointer> kept, gone;
+    for (int i = 0; i < 400; i++) {
+        Pointer p = a.alloc(1500 + i % 7 * 16);
+        memset(p.get(), i % 251, 1500);
+        (i % 2 ? gone : kept).push_back(p);
+    }
+    for (Pointer &p: gone) {
+        a.free(p);
+    }
+
+    a.start_compactor(100, 16 << 10);
+
+    // Readers only need an epoch; the writer pins what it writes to.
+    bool stop = false;
+    vector<int> ok(4, 1);
+    vector<thread> readers;
+    for (int t = 0; t < 3; t++) {
+        readers.push_back(thread([&a, &kept, &ok, &stop, t]() {
+            while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+                EpochGuard g(a.epochs());
+                for (size_t i = 0; i < kept.size(); i++) {
+                    const char *v = reinterpret_cast<const char*>(kept[i].get());
+                    if (v[0] != (char) (2 * i % 251) || v[1499] != (char) (2 * i % 251)) {
+                        ok[t] = 0;
+                    }
+                }
+            }
+        }));
+    }
+    for (int round = 0; round < 200; round++) {
+        Pointer p = a.alloc(3000);
+        {
+            PinGuard pin(p);
+            memset(p.get(), 7, 3000);
+            ok[3] = ok[3] && reinterpret_cast<char*>(p.get())[2999] == 7;
+        }
+        a.free(p);
+        this_thread::sleep_for(chrono::microseconds(200));
+    }
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+    for (thread &r: readers) {
+        r.join();
+    }
+    a.stop_compactor();
+
+    for (int t = 0; t < 4; t++) {
+        EXPECT_TRUE(ok[t]);
+    }
+    EXPECT_GT(a.get_stats().defrag_moved_bytes, 0u);
+    for (size_t i = 0; i < kept.size(); i++) {
+        char *v = reinterpret_cast<char*>(kept[i].get());
+        EXPECT_EQ(v[750], (char) (2 * i % 251));
+        a.free(kept[i]);
+    }
+
+    // Retired copies are back in the arena.
+    a.defrag();
+    Pointer all = a.alloc(big.size() - (1 << 16));
+    a.free(all);
+}
+
+TEST(Allocator, CompactorYieldsWhenStuck) {
+    vector<char> big(64 << 20);
+    Allocator a(big.data(), big.size(), true);
+
+    // Pinned blocks behind holes fill most of the arena: fragmented, but
+    // nothing the compactor may move. Both sizes bypass the thread caches.
+    vector<Pointer> kept;
+    for (int i = 0; i < 18000; i++) {
+        Pointer hole = a.alloc(1100);
+        kept.push_back(a.alloc(2000));
+        kept.back().pin();
+        a.free(hole);
+    }
+
+    a.start_compactor(1000, 4 << 10);
+
+    // A mutator's alloc waits for at most one step of 256 headers.
+    // The blocks are kept, so the compactor finds the arena unchanged after
+    // its first pass and stops walking it.
+    chrono::nanoseconds worst(0);
+    vector<Pointer> made;
+    for (int i = 0; i < 2000; i++) {
+        auto start = chrono::steady_clock::now();
+        made.push_back(a.alloc(1500));
+        worst = max(worst, chrono::steady_clock::now() - start);
+        this_thread::sleep_for(chrono::microseconds(20));
+    }
+    a.stop_compactor();
+    a.free_batch(made);
+
+    EXPECT_LT(worst, chrono::milliseconds(1));
+    EXPECT_EQ(a.get_stats().defrag_moved_bytes, 0u);
+    for (Pointer &p: kept) {
+        p.unpin();
+        a.free(p);
+    }
+}
+
+TEST(ArenaContainers, SurviveDefrag) {
+    vector<char> big(1 << 20);
+    Allocator a(big.data(), big.size());
+
+    {
+        // Interleaved with short-lived blocks, so defrag() has to move them.
+        ArenaVector<int> v(a);
+        ArenaString s(a, "arena");
+        vector<Pointer> junk;
+        for (int i = 0; i < 20000; i++) {
+            v.push_back(i);
+            if (i % 1000 == 0) {
+                junk.push_back(a.alloc(3000));
+                s += '-';
+                s += to_string(i);
+            }
+        }
+        for (Pointer &p: junk) {
+            a.free(p);
+        }
+        s.append(string_view(s).substr(0, 5));
+
+        void *before = v.data();
+        a.defrag();
+        EXPECT_NE(v.data(), before);
+
+        for (int i = 0; i < 20000; i++) {
+            EXPECT_EQ(v[i], i);
+        }
+        string expected = "arena";
+        for (int i = 0; i < 20000; i += 1000) {
+            expected += "-" + to_string(i);
+        }
+        expected += "arena";
+        EXPECT_EQ(string(s.c_str()), expected);
+        EXPECT_EQ(s.size(), expected.size());
+
+        v.resize(10);
+        v.shrink_to_fit();
+        EXPECT_EQ(v.capacity(), 10u);
+        EXPECT_EQ(v.back(), 9);
+
+        ArenaVector<int> w(std::move(v));
+        EXPECT_EQ(w.size(), 10u);
+        EXPECT_TRUE(v.empty());
+    }
+
+    Pointer p = a.alloc(big.size() - 1024);
+    a.free(p);
+}
+
+TEST(Allocator, DefragMovesLargeBlocks) {
+    vector<char> big(24 << 20);
+    Allocator a(big.data(), big.size());
+
+    // Large blocks of odd sizes behind holes from 48 bytes up, so that
+    // some moves overlap their own source.
+    size_t holes[] = {1, 100, 4000, 3 << 20};
+    vector<Pointer> kept;
+    vector<size_t> sizes;
+    for (size_t k = 0; k < 4; k++) {
+        Pointer h = a.alloc(holes[k]);
+        sizes.push_back((2 << 20) + 4 * k + 1);
+        kept.push_back(a.alloc(sizes.back()));
+        writeTo(kept.back(), sizes.back());
+        a.free(h);
+    }
+
+    vector<char*> before;
+    for (Pointer &p: kept) {
+        before.push_back(static_cast<char*>(p.get()));
+    }
+    a.defrag();
+    for (size_t k = 0; k < 4; k++) {
+        EXPECT_LT(static_cast<char*>(kept[k].get()), before[k]);
+        EXPECT_TRUE(isDataOk(kept[k], sizes[k]));
+    }
+    EXPECT_EQ(a.get_stats().free_blocks, 1u);
+}
+
+TEST(Allocator, CrossThreadFree) {
+    vector<char> big(4 << 20);
+    Allocator a(big.data(), big.size(), true);
+
+    // One thread allocates message buffers, the other checks and frees them;
+    // the frees go back to the producer's cache for it to reuse. The producer
+    // stays at most window messages ahead, so the arena never runs short.
+    const int messages = 20000;
+    const int window = 512;
+    std::mutex lock;
+    vector<Pointer> queue;
+    std::atomic<int> freed(0);
+    std::atomic<bool> failed(false);
+    bool ok = true;
+
+    thread consumer([&]() {
+        int seen = 0;
+        while (seen < messages && !failed) {
+            vector<Pointer> got;
+            {
+                std::lock_guard<std::mutex> g(lock);
+                got.swap(queue);
+            }
+            for (Pointer &p: got) {
+                ok = ok && *static_cast<int*>(p.get()) == seen++;
+                a.free(p);
+                freed++;
+            }
+        }
+    });
+    try {
+        for (int i = 0; i < messages; i++) {
+            while (i - freed >= window) {
+                std::this_thread::yield();
+            }
+            Pointer p = a.alloc(100 + i % 4 * 100);
+            *static_cast<int*>(p.get()) = i;
+            std::lock_guard<std::mutex> g(lock);
+            queue.push_back(p);
+        }
+    } catch (AllocError &) {
+        failed = true;
+    }
+    consumer.join();
+    ASSERT_FALSE(failed);
+    EXPECT_TRUE(ok);
+
+    AllocStats st = a.get_stats();
+    EXPECT_EQ(st.allocs, (uint64_t) messages);
+    EXPECT_EQ(st.frees, (uint64_t) messages);
+    EXPECT_EQ(st.remote_frees, (uint64_t) messages);
+    EXPECT_EQ(st.live_handles, 0u);
+
+    Pointer all = a.alloc(big.size() - (1 << 16));
+    a.free(all);
+}
+
+TEST(Allocator, DefragStepSkipsRemoteFrees) {
+    vector<char> big(1 << 20);
+    Allocator a(big.data(), big.size(), true);
+    a.set_defrag_threshold(0);
+
+    // A large block in front of small ones from this thread's cache; every
+    // other small one is then freed by another thread, which parks it on
+    // this thread's remote list.
+    Pointer front = a.alloc(64 << 10);
+    vector<Pointer> small, kept;
+    for (int i = 0; i < 64; i++) {
+        small.push_back(a.alloc(100));
+        writeTo(small.back(), 100);
+    }
+    a.free(front);
+
+    for (size_t i = 0; i < small.size(); i++) {
+        if (i % 2 == 0) {
+            kept.push_back(small[i]);
+        }
+    }
+    thread other([&]() {
+        for (size_t i = 1; i < small.size(); i += 2) {
+            a.free(small[i]);
+        }
+    });
+    other.join();
+
+    int steps = 0;
+    while (!a.defrag_step(4 << 10) && steps < 1000) {
+        steps++;
+    }
+    EXPECT_LT(steps, 1000);
+    for (Pointer &p: kept) {
+        EXPECT_TRUE(isDataOk(p, 100));
+        a.free(p);
+    }
+
+    Pointer all = a.alloc(big.size() - (1 << 16));
+    a.free(all);
+}
+
+TEST(Allocator, BatchFreeWhileCompacting) {
+    vector<char> big(4 << 20);
+    Allocator a(big.data(), big.size(), true);
+    a.set_defrag_threshold(0);
+    a.start_compactor(1, 1 << 20);
+
+    // Blocks too big for the thread caches; the holes the single frees
+    // leave keep the compactor moving the rest while they are batch-freed.
+    for (int round = 0; round < 1000; round++) {
+        vector<Pointer> ptrs;
+        for (int i = 0; i < 60; i++) {
+            ptrs.push_back(a.alloc(2048));
+        }
+        vector<Pointer> rest;
+        for (int i = 0; i < 60; i++) {
+            if (i % 3 == 0) {
+                a.free(ptrs[i]);
+            } else {
+                rest.push_back(ptrs[i]);
+            }
+        }
+        a.free_batch(rest);
+    }
+    a.stop_compactor();
+
+    AllocStats st = a.get_stats();
+    EXPECT_EQ(st.live_handles, 0u);
+    EXPECT_EQ(st.frees, st.allocs);
+    a.defrag();
+    Pointer all = a.alloc(big.size() - (1 << 16));
+    a.free(all);
+}
@@ -0,0 +1,208 @@
+#ifndef ARENA_CONTAINERS_H
+#define ARENA_CONTAINERS_H
+
+#include <algorithm>
+#include <string_view>
+#include <type_traits>
+#include <string.h>
+
+#include "allocator.h"
+
+// Growable containers whose storage is one unpinned block held by a Pointer.
+// They grow through Allocator::realloc() and go on working after defrag()
+// moves them, so large dynamic buffers can live in a compactable arena.
+// Addresses from data(), begin() or operator[] are only good until the next
+// call that may move the block: a growth, realloc, defrag() or
+// defrag_step(). Elements are moved with memmove, so T must be trivially
+// copyable. Not thread-safe.
+template <class T>
+class ArenaVector {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "arena blocks are moved with memmove");
+
+public:
+
+    explicit ArenaVector(Allocator &_a) : a(&_a), n(0), cap(0) { }
+
+    ArenaVector(ArenaVector &&other) : a(other.a), p(other.p), n(other.n), cap(other.cap)
+    {
+        other.p.set_null();
+        other.n = other.cap = 0;
+    }
+
+    ArenaVector &operator=(ArenaVector &&other)
+    {
+        if (this != &other)
+        {
+            release();
+            a = other.a;
+            p = other.p;
+            n = other.n;
+            cap = other.cap;
+            other.p.set_null();
+            other.n = other.cap = 0;
+        }
+        return *this;
+    }
+
+    ~ArenaVector() { release(); }
+
+    size_t size() const { return n; }
+    size_t capacity() const { return cap; }
+    bool empty() const { return n == 0; }
+
+    T *data() { return static_cast<T*>(p.get()); }
+    const T *data() const { return static_cast<const T*>(p.get()); }
+    T *begin() { return data(); }
+    T *end() { return data() + n; }
+    const T *begin() const { return data(); }
+    const T *end() const { return data() + n; }
+
+    T &operator[](size_t i) { return data()[i]; }
+    const T &operator[](size_t i) const { return data()[i]; }
+    T &back() { return data()[n - 1]; }
+
+    // The block itself, e.g. to pin it for a while.
+    const Pointer &handle() const { return p; }
+    Allocator &arena() const { return *a; }
+
+    void reserve(size_t want)
+    {
+        if (want > cap)
+            set_capacity(want);
+    }
+
+    void push_back(const T &v)
+    {
+        // v may live in this vector, so it is copied before the block moves.
+        T copy = v;
+        if (n == cap)
+            set_capacity(std::max<size_t>(2 * cap, 16));
+        data()[n++] = copy;
+    }
+
+    void pop_back() { n--; }
+
+    void append(const T *v, size_t count)
+    {
+        if (n + count > cap)
+        {
+            // v may point into this vector, which is about to move.
+            const T *old = data();
+            bool inside = old != NULL && v >= old && v < old + n;
+            size_t at = inside ? v - old : 0;
+            set_capacity(std::max(2 * cap, n + count));
+            if (inside)
+                v = data() + at;
+        }
+        memmove(data() + n, v, count * sizeof(T));
+        n += count;
+    }
+
+    // New elements are value-initialised.
+    void resize(size_t want)
+    {
+        reserve(want);
+        for (size_t i = n; i < want; i++)
+            data()[i] = T();
+        n = want;
+    }
+
+    void clear() { n = 0; }
+
+    void shrink_to_fit()
+    {
+        if (n == 0)
+            release();
+        else if (n < cap)
+            set_capacity(n);
+    }
+
+private:
+
+    ArenaVector(const ArenaVector &);
+    ArenaVector &operator=(const ArenaVector &);
+
+    void set_capacity(size_t want)
+    {
+        if (want > (size_t) -1 / sizeof(T))
+            throw AllocError(NoMemory, "ArenaVector: too many elements");
+
+        if (p.get_id() == -1 && alignof(T) > block_align)
+            p = a->alloc(want * sizeof(T), alignof(T));
+        else
+            a->realloc(p, want * sizeof(T));
+        cap = want;
+    }
+
+    void release()
+    {
+        if (p.get_id() != -1)
+            a->free(p);
+        n = cap = 0;
+    }
+
+    Allocator *a;
+    Pointer p;
+    size_t n, cap;
+};
+
+// A byte string on an ArenaVector. The characters are kept NUL-terminated,
+// so c_str() needs no copy.
+class ArenaString {
+public:
+
+    explicit ArenaString(Allocator &a) : chars(a) { }
+
+    ArenaString(Allocator &a, std::string_view s) : chars(a) { append(s); }
+
+    size_t size() const { return chars.empty() ? 0 : chars.size() - 1; }
+    bool empty() const { return size() == 0; }
+
+    const char *c_str() const { return chars.empty() ? "" : chars.data(); }
+    char *data() { return chars.empty() ? NULL : chars.data(); }
+    char &operator[](size_t i) { return chars[i]; }
+    char operator[](size_t i) const { return chars[i]; }
+
+    const Pointer &handle() const { return chars.handle(); }
+
+    operator std::string_view() const { return std::string_view(c_str(), size()); }
+
+    ArenaString &append(std::string_view s)
+    {
+        if (chars.empty())
+            chars.push_back('\0');
+        chars.pop_back();
+        chars.append(s.data(), s.size());
+        chars.push_back('\0');
+        return *this;
+    }
+
+    ArenaString &operator+=(std::string_view s) { return append(s); }
+    ArenaString &operator+=(char c) { return append(std::string_view(&c, 1)); }
+
+    ArenaString &assign(std::string_view s)
+    {
+        clear();
+        return append(s);
+    }
+
+    void reserve(size_t want) { chars.reserve(want + 1); }
+
+    void clear()
+    {
+        if (!chars.empty())
+        {
+            chars.clear();
+            chars.push_back('\0');
+        }
+    }
+
+    bool operator==(std::string_view s) const { return std::string_view(*this) == s; }
+    bool operator!=(std::string_view s) const { return !(*this == s); }
+
+private:
+    ArenaVector<char> chars;
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef ARENA_RESOURCE_H
+#define ARENA_RESOURCE_H
+
+#include <memory_resource>
+#include <new>
+
+#include "allocator.h"
+
+// Adapters that let standard containers allocate from an Allocator. Both
+// hand out pinned blocks (see Allocator::alloc_pinned), so the memory is
+// never relocated by defrag() and the arena compacts around it.
+
+class ArenaResource : public std::pmr::memory_resource {
+public:
+
+    explicit ArenaResource(Allocator &_a) : a(_a) { }
+
+    Allocator &arena() const { return a; }
+
+private:
+
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        try
+        {
+            return a.alloc_pinned(bytes, alignment);
+        }
+        catch (AllocError &)
+        {
+            throw std::bad_alloc();
+        }
+    }
+
+    void do_deallocate(void *p, size_t, size_t) override
+    {
+        a.free_pinned(p);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        const ArenaResource *r = dynamic_cast<const ArenaResource*>(&other);
+        return r != NULL && &r->a == &a;
+    }
+
+    Allocator &a;
+};
+
+// Classic allocator for containers that take an allocator type parameter.
+template <class T>
+class ArenaAllocator {
+public:
+
+    typedef T value_type;
+
+    explicit ArenaAllocator(Allocator &_a) : a(&_a) { }
+
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : a(&other.arena()) { }
+
+    T *allocate(size_t n)
+    {
+        if (n > (size_t) -1 / sizeof(T))
+            throw std::bad_alloc();
+
+        try
+        {
+            return static_cast<T*>(a->alloc_pinned(n * sizeof(T), alignof(T)));
+        }
+        catch (AllocError &)
+        {
+            throw std::bad_alloc();
+        }
+    }
+
+    void deallocate(T *p, size_t)
+    {
+        a->free_pinned(p);
+    }
+
+    Allocator &arena() const { return *a; }
+
+private:
+    Allocator *a;
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T> &x, const ArenaAllocator<U> &y)
+{
+    return &x.arena() == &y.arena();
+}
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T> &x, const ArenaAllocator<U> &y)
+{
+    return !(x == y);
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+#include <new>
+#include <utility>
+
+#include "allocator.h"
+
+// Hands out fixed-size slots for objects of type T from slabs carved out of
+// an Allocator. A slab keeps its free slots in one 64-bit map and is aligned
+// to its own power-of-two size, so free() finds the slab by masking the
+// object address: nothing is stored per object. Slabs are pinned, so the
+// objects never move under defrag(). A pool is not thread-safe.
+template <class T>
+class SlabPool {
+public:
+
+    explicit SlabPool(Allocator &_a) : a(_a), partial(NULL), full(NULL) { }
+
+    ~SlabPool()
+    {
+        release_list(partial);
+        release_list(full);
+    }
+
+    // Returns uninitialised storage for one T.
+    T *alloc()
+    {
+        if (partial == NULL)
+            new_slab();
+
+        Slab *s = partial;
+        int k = __builtin_ctzll(s->free_map);
+        s->free_map &= s->free_map - 1;
+        if (s->free_map == 0)
+        {
+            unlink(partial, s);
+            push(full, s);
+        }
+        return reinterpret_cast<T*>(
+                reinterpret_cast<int8_t*>(s) + objects_offset + k * sizeof(T));
+    }
+
+    void free(T *obj)
+    {
+        uintptr_t at = reinterpret_cast<uintptr_t>(obj);
+        Slab *s = reinterpret_cast<Slab*>(at & ~(uintptr_t) (slab_bytes - 1));
+        size_t k = (at - reinterpret_cast<uintptr_t>(s) - objects_offset) / sizeof(T);
+
+        if (s->free_map == 0)
+        {
+            unlink(full, s);
+            push(partial, s);
+        }
+        s->free_map |= 1ULL << k;
+
+        // Keep one empty slab around, give the others back to the arena.
+        if (s->free_map == full_map && (s != partial || s->next != NULL))
+        {
+            unlink(partial, s);
+            release(s);
+        }
+    }
+
+    template <class... Args>
+    T *create(Args&&... args)
+    {
+        return new (alloc()) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T *obj)
+    {
+        obj->~T();
+        free(obj);
+    }
+
+private:
+
+    struct Slab {
+        Pointer block;
+        uint64_t free_map;          // bit k set: slot k is free
+        Slab *next, *prev;
+    };
+
+    static constexpr size_t round_pow2(size_t x, size_t p = 1)
+    {
+        return p >= x ? p : round_pow2(x, p * 2);
+    }
+
+    static constexpr size_t objects_offset =
+            (sizeof(Slab) + alignof(T) - 1) / alignof(T) * alignof(T);
+    static constexpr size_t slab_bytes = round_pow2(objects_offset + 64 * sizeof(T));
+    static constexpr size_t slab_objects =
+            (slab_bytes - objects_offset) / sizeof(T) < 64 ?
+            (slab_bytes - objects_offset) / sizeof(T) : 64;
+    static constexpr uint64_t full_map =
+            slab_objects == 64 ? ~0ULL : (1ULL << slab_objects) - 1;
+
+    SlabPool(const SlabPool &);
+    SlabPool &operator=(const SlabPool &);
+
+    void new_slab()
+    {
+        Pointer block = a.handle_of(a.alloc_pinned(slab_bytes, slab_bytes));
+
+        Slab *s = new (block.get()) Slab();
+        s->block = block;
+        s->free_map = full_map;
+        push(partial, s);
+    }
+
+    void release(Slab *s)
+    {
+        a.free_pinned(s->block.get());
+    }
+
+    void release_list(Slab *list)
+    {
+        while (list != NULL)
+        {
+            Slab *next = list->next;
+            release(list);
+            list = next;
+        }
+    }
+
+    static void push(Slab *&list, Slab *s)
+    {
+        s->prev = NULL;
+        s->next = list;
+        if (list != NULL)
+            list->prev = s;
+        list = s;
+    }
+
+    static void unlink(Slab *&list, Slab *s)
+    {
+        if (s->prev != NULL)
+            s->prev->next = s->next;
+        else
+            list = s->next;
+        if (s->next != NULL)
+            s->next->prev = s->prev;
+    }
+
+    Allocator &a;
+    Slab *partial, *full;
+};
+
+#endif